@@ -0,0 +1,182 @@
+// Thread scaling of from_protobuf_batch() and to_protobuf_batch(), at 1..N threads.
+//
+// Each batch is run on a PBThreadPool of every size from 1 to N (default: the number of
+// cores) and, for decoding, also on the shared-counter scheduler PBThreadPool had before it
+// stole work, so the two can be compared on the same machine. The "uniform" batch has
+// messages of one size; in the "skewed" batch the first 1% are about 100 times larger.
+//
+// Build and run from the repository root:
+//   g++ -std=c++20 -O2 src/*.cpp -o protocpp
+//   ./protocpp bench/batch.proto batch.pb.h batch.pb.cpp
+//   g++ -std=c++20 -O2 -pthread -I. -Isupport/include batch.pb.cpp bench/batch.cpp -o batch
+//   ./batch [max threads] [messages] > bench_output.txt
+
+#include "batch.pb.h"
+#include "Parallel.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <stdexcept>
+
+using namespace bench;
+
+// PBThreadPool's previous scheduler: every thread takes the next chunk from one shared counter.
+class CounterPool
+{
+public:
+  explicit CounterPool(size_t threads)
+  {
+    for (size_t n = 1; n < threads; n++)
+      workers_.emplace_back([this] { run(); });
+  }
+  ~CounterPool()
+  {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_)
+      worker.join();
+  }
+  template <typename F>
+  void parallelFor(size_t count, size_t grain, F&& f)
+  {
+    std::function<void(size_t, size_t)> call = f;
+    next_                                    = 0;
+    count_                                   = count;
+    grain_                                   = std::max<size_t>(grain, 1);
+    {
+      std::lock_guard lock(mutex_);
+      call_ = &call;
+      generation_++;
+      active_ = workers_.size();
+    }
+    wake_.notify_all();
+    work();
+    std::unique_lock lock(mutex_);
+    done_.wait(lock, [&] { return active_ == 0; });
+  }
+
+private:
+  void work()
+  {
+    for (;;)
+    {
+      size_t begin = next_.fetch_add(grain_, std::memory_order_relaxed);
+      if (begin >= count_)
+        return;
+      (*call_)(begin, std::min(begin + grain_, count_));
+    }
+  }
+  void run()
+  {
+    size_t           seen = 0;
+    std::unique_lock lock(mutex_);
+    for (;;)
+    {
+      wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+      if (stop_)
+        return;
+      seen = generation_;
+      lock.unlock();
+      work();
+      lock.lock();
+      if (--active_ == 0)
+        done_.notify_one();
+    }
+  }
+
+  std::vector<std::thread>                   workers_;
+  std::mutex                                 mutex_;
+  std::condition_variable                    wake_;
+  std::condition_variable                    done_;
+  const std::function<void(size_t, size_t)>* call_ = nullptr;
+  std::atomic<size_t>                        next_{ 0 };
+  size_t                                     count_      = 0;
+  size_t                                     grain_      = 1;
+  size_t                                     generation_ = 0;
+  size_t                                     active_     = 0;
+  bool                                       stop_       = false;
+};
+
+static std::vector<Quote> makeBatch(size_t count, bool skewed)
+{
+  std::vector<Quote> batch(count);
+  for (size_t n = 0; n < count; n++)
+  {
+    Quote& q = batch[n];
+    q.id     = n;
+    q.price  = 100.0 + n % 97;
+    q.qty    = n * 31 % 1000;
+    q.venue  = "XNAS";
+    q.deltas.resize(skewed && n < count / 100 ? 1600 : 16);
+    for (size_t k = 0; k < q.deltas.size(); k++)
+      q.deltas[k] = int32_t(k * 7 % 201) - 100;
+  }
+  return batch;
+}
+
+// Fastest of a few runs, in milliseconds.
+template <typename F>
+static double best(F&& f)
+{
+  double rv = 1e300;
+  for (int run = 0; run < 5; run++)
+  {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+    rv = std::min(rv, took.count());
+  }
+  return rv;
+}
+
+static void runBatch(const char* name, const std::vector<Quote>& batch, size_t maxThreads)
+{
+  PBVector            records = to_protobuf_batch(batch, PBThreadPool::shared());
+  std::vector<PBView> views;
+  for (PBView record : PBRecords(records))
+    views.push_back(record);
+  double mb = records.size() / 1e6;
+  printf("%s: %zu messages, %.1f MB\n", name, batch.size(), mb);
+  printf("%8s %14s %14s %14s\n", "threads", "decode ms", "counter ms", "encode ms");
+  for (size_t threads = 1; threads <= maxThreads; threads++)
+  {
+    PBThreadPool pool(threads);
+    CounterPool  counter(threads);
+    size_t       grain  = pbGrain(views.size(), pool, 64);
+    double       decode = best([&] { from_protobuf_batch<Quote>(views, pool); });
+    double       byCounter = best(
+      [&]
+      {
+        std::vector<Quote> out(views.size());
+        counter.parallelFor(views.size(), grain,
+                            [&](size_t begin, size_t end)
+                            {
+                              for (size_t n = begin; n < end; n++)
+                                out[n] = from_protobuf<Quote>(views[n]);
+                            });
+      });
+    double encode = best(
+      [&]
+      {
+        if (to_protobuf_batch(batch, pool).size() != records.size())
+          throw std::runtime_error("Batch encoding changed size");
+      });
+    printf("%8zu %14.2f %14.2f %14.2f\n", threads, decode, byCounter, encode);
+  }
+  printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+  size_t maxThreads = argc > 1 ? strtoul(argv[1], nullptr, 10)
+                               : std::max(1u, std::thread::hardware_concurrency());
+  size_t count      = argc > 2 ? strtoul(argv[2], nullptr, 10) : 200000;
+  printf("%u cores\n\n", std::thread::hardware_concurrency());
+  runBatch("uniform", makeBatch(count, false), maxThreads);
+  runBatch("skewed", makeBatch(count, true), maxThreads);
+  return 0;
+}
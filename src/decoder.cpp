@@ -1,9 +1,463 @@
 #include "outputs.h"
 #include "protobuf_defs.h"
 #include "toCpp.h"
-#include <algorithm>
 #include <iostream>
 
+static std::string readExpression(ProtoFile& file, const std::string& prefix, const Field& f, bool view, bool pmr)
+{
+  if (f.type == "bytes")
+  {
+    return view ? "entry.readBytesView()" : pmr ? "entry.readBytes(arena)" : "entry.readBytes()";
+  }
+  else if (f.type == "string")
+  {
+    return view ? "entry.readStringView()" : pmr ? "entry.readString(arena)" : "entry.readString()";
+  }
+  else if (f.type == "double")
+  {
+    return "entry.readDouble()";
+  }
+  else if (f.type == "float")
+  {
+    return "(float)entry.readDouble()";
+  }
+  else if (file.isLazy(f))
+  {
+    return "Lazy<" + prefix + f.type + (view ? "View" : "") + ">(entry.pbview())";
+  }
+  else if (file.isMessage(f.type))
+  {
+    return "from_protobuf<" + prefix + f.type + (view ? "View" : "") + ">(entry.pbview()"
+           + (pmr ? ", arena)" : ")");
+  }
+  else if (file.isEnum(f.type))
+  {
+    return "(" + prefix + f.type + ")entry.read()";
+  }
+  else if (isZigZag(f.type))
+  {
+    return "(" + toCpp(f.type) + ")unzigzag(entry.read())";
+  }
+  else
+  {
+    return "(" + toCpp(f.type) + ")entry.read()";
+  }
+}
+
+static std::string packedReader(const Field& f)
+{
+  if (isFixed32(f.type) || isFixed64(f.type))
+  {
+    return "entry.readPackedFixed(rv." + f.name + ")";
+  }
+  else if (isZigZag(f.type))
+  {
+    return "entry.readPackedZigZag(rv." + f.name + ")";
+  }
+  return "entry.readPackedVarint(rv." + f.name + ")";
+}
+
+static std::string reader(ProtoFile&         file,
+                          const std::string& prefix,
+                          const Field&       f,
+                          bool               view,
+                          bool               pmr)
+{
+  if (f.isMap())
+  {
+    // The entry's own iterator is also called `entry`, so the usual read expressions apply.
+    // pbReadMapEntry() builds key and value with the map's allocator; owned strings, bytes and
+    // submessages are decoded into them so that they stay with it.
+    auto part = [&](const Field& p)
+    {
+      std::string target = p.name;
+      if (view || file.isPackable(p.type))
+        return target + " = " + readExpression(file, prefix, p, view, pmr);
+      if (file.isMessage(p.type))
+        return "decode_into(entry.pbview(), " + target + ")";
+      return (p.type == "string" ? "entry.readStringInto(" : "entry.readBytesInto(") + target
+             + ")";
+    };
+    Field key = ProtoFile::mapKey(f), value = ProtoFile::mapValue(f);
+    return "pbReadMapEntry(rv." + f.name
+           + ", entry.pbview(), [&](PBView::iterator& entry, auto& key, auto& value) { "
+             "switch (entry.tag) { case "
+           + file.tagFor(key) + ".bytes: " + part(key) + "; break; case " + file.tagFor(value)
+           + ".bytes: " + part(value) + "; break; } })";
+  }
+  if (!f.oneof.empty())
+  {
+    std::string k = std::to_string(f.alternative);
+    if (file.isMessage(f.type))
+    {
+      return "pbMergeAlternative<" + k + ">(rv." + f.oneof + ", entry.pbview()"
+             + (pmr ? ", arena)" : ")");
+    }
+    return "rv." + f.oneof + ".emplace<" + k + ">(" + readExpression(file, prefix, f, view, pmr)
+           + ")";
+  }
+  if (f.repeated)
+  {
+    return "rv." + f.name + ".push_back(" + readExpression(file, prefix, f, view, pmr) + ")";
+  }
+  // A submessage that occurs again is merged into the one decoded before, as protobuf requires.
+  if (file.isLazy(f))
+  {
+    return "rv." + f.name + ".merge(entry.pbview())";
+  }
+  if (file.isMessage(f.type))
+  {
+    return "merge_from_protobuf(entry.pbview(), rv." + f.name + (pmr ? ", arena)" : ")");
+  }
+  return "rv." + f.name + " = " + readExpression(file, prefix, f, view, pmr);
+}
+
+// decode_into() decodes over what the object already holds. Submessages, and owned strings and
+// bytes in repeated fields, count the elements decoded so far in a `used_` local, so existing
+// elements are reused and the rest cut off at the end.
+static bool counted(ProtoFile& file, const Field& f, bool view)
+{
+  if (f.isMap() || !f.oneof.empty())
+  {
+    return false;
+  }
+  if (file.isMessage(f.type))
+  {
+    return !file.isLazy(f);
+  }
+  return f.repeated && !view && (f.type == "string" || f.type == "bytes");
+}
+
+static std::string intoReader(ProtoFile&         file,
+                              const std::string& prefix,
+                              const Field&       f,
+                              bool               view)
+{
+  // A oneof counts in `used_` whether any alternative was decoded. The one that is still set is
+  // decoded over like a singular field.
+  if (!f.oneof.empty())
+  {
+    std::string used   = "; used_" + f.oneof + " = 1";
+    std::string target = "pbAlternative<" + std::to_string(f.alternative) + ">(rv." + f.oneof + ")";
+    if (file.isMessage(f.type))
+    {
+      return "if (used_" + f.oneof + ") merge_from_protobuf(entry.pbview(), " + target
+             + "); else decode_into(entry.pbview(), " + target + ")" + used;
+    }
+    else if (!view && (f.type == "string" || f.type == "bytes"))
+    {
+      return (f.type == "string" ? "entry.readStringInto(" : "entry.readBytesInto(") + target + ")"
+             + used;
+    }
+    return reader(file, prefix, f, view, false) + used;
+  }
+  if (f.isMap() || (!counted(file, f, view) && (view || (f.type != "string" && f.type != "bytes"))))
+  {
+    return reader(file, prefix, f, view, false);
+  }
+  std::string target =
+    f.repeated ? "pbNext(rv." + f.name + ", used_" + f.name + ")" : "rv." + f.name;
+  if (file.isMessage(f.type) && f.repeated)
+  {
+    return "decode_into(entry.pbview(), " + target + ")";
+  }
+  if (file.isMessage(f.type))
+  {
+    return "if (used_" + f.name + ") merge_from_protobuf(entry.pbview(), " + target
+           + "); else decode_into(entry.pbview(), " + target + "); used_" + f.name + " = 1";
+  }
+  return (f.type == "string" ? "entry.readStringInto(" : "entry.readBytesInto(") + target + ")";
+}
+
+static void output_into_prologue(std::ostream&  os,
+                                 ProtoFile&     file,
+                                 const Message& message,
+                                 bool           view)
+{
+  for (auto& f : message.fields)
+  {
+    if (!f.oneof.empty())
+    {
+      if (f.alternative == 1)
+      {
+        os << "  size_t used_" << f.oneof << " = 0;\n";
+      }
+    }
+    else if (counted(file, f, view))
+    {
+      os << "  size_t used_" << f.name << " = 0;\n";
+    }
+    else if (f.repeated || f.isMap() || (!view && (f.type == "string" || f.type == "bytes")))
+    {
+      os << "  rv." << f.name << ".clear();\n";
+    }
+    else
+    {
+      os << "  rv." << f.name << " = {};\n";
+    }
+  }
+}
+
+static void output_into_epilogue(std::ostream&  os,
+                                 ProtoFile&     file,
+                                 const Message& message,
+                                 bool           view)
+{
+  for (auto& f : message.fields)
+  {
+    if (f.alternative == 1)
+    {
+      os << "  if (!used_" << f.oneof << ")\n    rv." << f.oneof << " = {};\n";
+    }
+    if (!counted(file, f, view))
+    {
+      continue;
+    }
+    if (f.repeated)
+    {
+      os << "  rv." << f.name << ".resize(used_" << f.name << ");\n";
+    }
+    else
+    {
+      os << "  if (!used_" << f.name << ")\n    decode_into(PBView(nullptr, 0), rv." << f.name
+         << ");\n";
+    }
+  }
+}
+
+// Maps, and with --reserve the repeated fields that are not packed, are counted in a first pass
+// that only compares tags, and each is reserved to its final size so that inserting never
+// rehashes or reallocates. Packed fields need no pass: the packed readers size the vector from
+// the byte length.
+static bool reserved(ProtoFile& file, const Field& f)
+{
+  return f.isMap() || (file.options.reserve && f.repeated && !file.isPackable(f.type));
+}
+
+static bool hasReserved(ProtoFile& file, const Message& message)
+{
+  return std::any_of(message.fields.begin(), message.fields.end(),
+                     [&](const Field& f) { return reserved(file, f); });
+}
+
+static void output_reserve(std::ostream& os, ProtoFile& file, const Message& message)
+{
+  std::vector<const Field*> repeated;
+  for (auto& f : message.fields)
+  {
+    if (reserved(file, f))
+    {
+      repeated.push_back(&f);
+    }
+  }
+  if (repeated.empty())
+  {
+    return;
+  }
+  os << "  {\n";
+  for (auto* f : repeated)
+  {
+    os << "    size_t count_" << f->name << " = 0;\n";
+  }
+  os << "    for (auto& e : data) {\n      switch (e.tag) {\n";
+  for (auto* f : repeated)
+  {
+    os << "        case " << file.tagFor(*f) << ".bytes: count_" << f->name << "++; break;\n";
+  }
+  os << "      }\n    }\n";
+  for (auto* f : repeated)
+  {
+    os << "    rv." << f->name << ".reserve(count_" << f->name << ");\n";
+  }
+  os << "  }\n";
+}
+
+// Encoders write fields in declaration order, so the decoder first walks the fields in that
+// order and only compares the next tag against the one expected there. Fields that are absent
+// cost one compare each; anything out of order or unknown is left to the switch after it.
+// With `projected`, a field is only read if its bit is set in `fields`; otherwise the iterator
+// steps over it by length alone, and `rv` is returned. Otherwise the body of
+// merge_from_protobuf() is emitted, which decodes onto `rv` as it is, or with `into` that of
+// decode_into().
+static void output_fields(std::ostream&      os,
+                          ProtoFile&         file,
+                          const std::string& prefix,
+                          const Message&     message,
+                          bool               view,
+                          bool               pmr,
+                          bool               projected,
+                          bool               into = false)
+{
+  std::string name = prefix + message.name + (view ? "View" : "");
+  auto        guard = [&](const Field& f, size_t n)
+  {
+    return projected && n < 64 ? "if (fields & " + name + "::Fields::" + f.name + ") " : "";
+  };
+  auto read = [&](const Field& f)
+  { return into ? intoReader(file, prefix, f, view) : reader(file, prefix, f, view, pmr); };
+  if (into)
+  {
+    output_into_prologue(os, file, message, view);
+  }
+  os << "  auto entry = data.begin();\n";
+  for (size_t n = 0; n < message.fields.size(); n++)
+  {
+    auto& f = message.fields[n];
+    if (!f.oneof.empty())
+    {
+      // At most one alternative is on the wire, so they are tried with one switch.
+      os << "  if (entry != data.end()) {\n    switch (entry.tag) {\n";
+      for (; n < message.fields.size() && message.fields[n].oneof == f.oneof; n++)
+      {
+        auto& a = message.fields[n];
+        os << "      case " << file.tagFor(a) << ".bytes: " << guard(a, n) << read(a)
+           << "; ++entry; break;\n";
+      }
+      os << "    }\n  }\n";
+      n--;
+      continue;
+    }
+    if (f.repeated && file.isPackable(f.type))
+    {
+      os << "  if (entry != data.end() && entry.tag == " << file.tagFor(f, true)
+         << ".bytes) {\n    " << guard(f, n) << packedReader(f) << ";\n    ++entry;\n  }\n";
+    }
+    os << "  " << (f.repeated || f.isMap() ? "while" : "if")
+       << " (entry != data.end() && entry.tag == " << file.tagFor(f) << ".bytes) {\n    "
+       << guard(f, n) << read(f) << ";\n    ++entry;\n  }\n";
+  }
+  os << "  for (; entry != data.end(); ++entry) {\n    switch (entry.tag) {\n";
+  for (size_t n = 0; n < message.fields.size(); n++)
+  {
+    auto& f = message.fields[n];
+    if (f.repeated && file.isPackable(f.type))
+    {
+      // Accept both the packed and the unpacked form, as proto3 parsers must.
+      os << "      case " << file.tagFor(f, true) << ".bytes: " << guard(f, n) << packedReader(f)
+         << "; break;\n";
+    }
+    os << "      case " << file.tagFor(f) << ".bytes: " << guard(f, n) << read(f)
+       << "; break;\n";
+  }
+  os << "    }\n  }\n";
+  if (into)
+  {
+    output_into_epilogue(os, file, message, view);
+  }
+  os << (projected ? "  return rv;\n}\n\n" : "}\n\n");
+}
+
+// The one full decoder body of a message; from_protobuf() and the readers of singular
+// submessages call it, so it is emitted first.
+static void output_merge(std::ostream&      os,
+                         ProtoFile&         file,
+                         const std::string& prefix,
+                         const Message&     message,
+                         bool               view)
+{
+  std::string name = prefix + message.name + (view ? "View" : "");
+  bool        pmr  = file.options.pmr && !view;
+  os << "template <>\nvoid merge_from_protobuf<" << name << ">(PBView data, " << name << "& rv";
+  if (pmr)
+  {
+    os << ", std::pmr::memory_resource&" << (file.options.tables ? "" : " arena");
+  }
+  os << ") {\n";
+  if (file.options.tables)
+  {
+    os << "  tableDecode(" << tableName(message.name, view) << ", &rv, data);\n}\n\n";
+  }
+  else
+  {
+    // Messages without strings, bytes or submessages have nothing to allocate.
+    if (pmr)
+    {
+      os << "  (void)arena;\n";
+    }
+    output_fields(os, file, prefix, message, view, pmr, false);
+  }
+  if (pmr)
+  {
+    os << "template <>\nvoid merge_from_protobuf<" << name << ">(PBView data, " << name
+       << "& rv) {\n  merge_from_protobuf(data, rv, *std::pmr::get_default_resource());\n}\n\n";
+  }
+}
+
+static void output_from_protobuf(std::ostream&      os,
+                                 ProtoFile&         file,
+                                 const std::string& prefix,
+                                 const Message&     message,
+                                 bool               view)
+{
+  std::string name = message.name + (view ? "View" : "");
+  // In --pmr mode the struct and everything it owns is allocated from a caller's resource; the
+  // plain overload uses the default resource.
+  bool pmr = file.options.pmr && !view;
+  output_merge(os, file, prefix, message, view);
+  if (pmr)
+  {
+    os << "template <>\n"
+       << prefix << name << " from_protobuf<" << prefix << name
+       << ">(PBView data, std::pmr::memory_resource& arena) {\n";
+    os << "  " << prefix << name << " rv(&arena);\n";
+  }
+  else
+  {
+    os << "template <>\n"
+       << prefix << name << " from_protobuf<" << prefix << name << ">(PBView data) {\n";
+    os << "  " << prefix << name << " rv;\n";
+  }
+  // The fields themselves are decoded by merge_from_protobuf(), once the containers that can
+  // be counted up front are reserved.
+  if (file.options.tables && hasReserved(file, message))
+  {
+    os << "  tableReserve(" << tableName(message.name, view) << ", &rv, data);\n";
+  }
+  else if (!file.options.tables)
+  {
+    output_reserve(os, file, message);
+  }
+  os << "  merge_from_protobuf(data, rv" << (pmr ? ", arena" : "") << ");\n  return rv;\n}\n\n";
+  if (pmr)
+  {
+    os << "template <>\n"
+       << prefix << name << " from_protobuf<" << prefix << name << ">(PBView data) {\n"
+       << "  return from_protobuf<" << prefix << name
+       << ">(data, *std::pmr::get_default_resource());\n}\n\n";
+  }
+  os << "template <>\n"
+     << prefix << name << " from_protobuf<" << prefix << name
+     << ">(PBView data, uint64_t fields) {\n";
+  if (pmr)
+  {
+    os << "  std::pmr::memory_resource& arena = *std::pmr::get_default_resource();\n";
+    os << "  " << prefix << name << " rv(&arena);\n";
+  }
+  else
+  {
+    os << "  " << prefix << name << " rv;\n";
+  }
+  if (file.options.tables)
+  {
+    os << "  tableDecode(" << tableName(message.name, view)
+       << ", &rv, data, fields);\n  return rv;\n}\n\n";
+  }
+  else
+  {
+    output_fields(os, file, prefix, message, view, pmr, true);
+  }
+  os << "template <>\nvoid decode_into<" << prefix << name << ">(PBView data, " << prefix << name
+     << "& rv) {\n";
+  if (file.options.tables)
+  {
+    os << "  tableDecodeInto(" << tableName(message.name, view) << ", &rv, data);\n}\n\n";
+  }
+  else
+  {
+    output_fields(os, file, prefix, message, view, pmr, false, true);
+  }
+}
+
 void output_decoder(std::ostream& os, ProtoFile& file)
 {
   os << "#include \"Protobuf.h\"\n\n";
@@ -15,62 +469,7 @@ void output_decoder(std::ostream& os, ProtoFile& file)
   for (auto& [_, message] : file.messages)
   {
     (void)_;
-    os << "template <>\n"
-       << prefix << message.name << " from_protobuf<" << prefix << message.name
-       << ">(PBView data) {\n";
-    os << "  " << prefix << message.name
-       << " rv;\n  for (auto& entry : data) {\n    switch (entry.number) {\n";
-    for (auto& f : message.fields)
-    {
-      os << "      case " << f.index << ": rv." << f.name;
-      if (f.repeated)
-      {
-        os << ".push_back(";
-      }
-      else
-      {
-        os << " = ";
-      }
-      if (f.type == "bytes")
-      {
-        os << "entry.readBytes()";
-      }
-      else if (f.type == "string")
-      {
-        os << "entry.readString()";
-      }
-      else if (f.type == "double")
-      {
-        os << "entry.readDouble()";
-      }
-      else if (f.type == "float")
-      {
-        os << "(float)entry.readDouble()";
-      }
-      else if (std::find_if(file.messages.begin(),
-                            file.messages.end(),
-                            [&](auto a) { return a.first == f.type; })
-                 != file.messages.end()
-               || file.importMessages.find(f.type) != file.importMessages.end())
-      {
-        os << "from_protobuf<" << prefix << f.type << ">(entry.pbview())";
-      }
-      else if (file.enums.find(f.type) != file.enums.end()
-               || file.importEnums.find(f.type) != file.importEnums.end())
-      {
-        os << "(" << prefix << f.type << ")entry.read()";
-      }
-      else
-      {
-        os << "(" << toCpp(f.type) << ")entry.read()";
-      }
-
-      if (f.repeated)
-      {
-        os << ")";
-      }
-      os << "; break;\n";
-    }
-    os << "    }\n  }\n  return rv;\n}\n\n";
+    output_from_protobuf(os, file, prefix, message, false);
+    output_from_protobuf(os, file, prefix, message, true);
   }
 }
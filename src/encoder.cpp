@@ -1,8 +1,184 @@
 #include "outputs.h"
 #include "protobuf_defs.h"
-#include <algorithm>
+#include "toCpp.h"
 #include <iostream>
 
+static std::string sizeExpression(ProtoFile& file, const Field& f, const std::string& element)
+{
+  std::string tag = file.tagFor(f);
+  if (f.isMap())
+  {
+    return "sizeMapEntry(" + tag + ", sizes, [&] { return "
+           + sizeExpression(file, ProtoFile::mapKey(f), element + ".first") + " + "
+           + sizeExpression(file, ProtoFile::mapValue(f), element + ".second") + "; })";
+  }
+  if (f.repeated && file.isPackable(f.type))
+  {
+    std::string packedTag = file.tagFor(f, true);
+    if (isFixed32(f.type) || isFixed64(f.type))
+    {
+      return "sizePackedFixed(" + packedTag + ", " + element + ")";
+    }
+    else if (isZigZag(f.type))
+    {
+      return "sizePackedZigZag(" + packedTag + ", " + element + ", sizes)";
+    }
+    return "sizePackedVarint(" + packedTag + ", " + element + ", sizes)";
+  }
+  // A oneof alternative that is set is written even if it holds the default value.
+  std::string present = f.oneof.empty() ? "" : ", true";
+  if (f.type == "fixed32" || f.type == "sfixed32")
+  {
+    return "sizeInt32(" + tag + ", " + element + present + ")";
+  }
+  else if (f.type == "fixed64" || f.type == "sfixed64")
+  {
+    return "sizeInt64(" + tag + ", " + element + present + ")";
+  }
+  else if (f.type == "string" || f.type == "bytes")
+  {
+    return "sizeLengthDelim(" + tag + ", " + element + present + ")";
+  }
+  else if (f.type == "float")
+  {
+    return "sizeFloat(" + tag + ", " + element + ")";
+  }
+  else if (f.type == "double")
+  {
+    return "sizeDouble(" + tag + ", " + element + ")";
+  }
+  else if (file.isMessage(f.type))
+  {
+    return "sizeMessage(" + tag + ", " + element + ", sizes" + present + ")";
+  }
+  else if (file.isEnum(f.type))
+  {
+    return "sizeVarint(" + tag + ", (uint32_t)" + element + present + ")";
+  }
+  else if (isZigZag(f.type))
+  {
+    return "sizeVarint(" + tag + ", zigzag(" + element + ")" + present + ")";
+  }
+  return "sizeVarint(" + tag + ", " + element + present + ")";
+}
+
+static std::string encodeStatement(ProtoFile& file, const Field& f, const std::string& element)
+{
+  std::string tag = file.tagFor(f);
+  if (f.isMap())
+  {
+    return "out.addMapEntry(" + tag + ", sizes, [&] { "
+           + encodeStatement(file, ProtoFile::mapKey(f), element + ".first") + "; "
+           + encodeStatement(file, ProtoFile::mapValue(f), element + ".second") + "; })";
+  }
+  if (f.repeated && file.isPackable(f.type))
+  {
+    std::string packedTag = file.tagFor(f, true);
+    if (isFixed32(f.type) || isFixed64(f.type))
+    {
+      return "out.addPackedFixed(" + packedTag + ", " + element + ")";
+    }
+    else if (isZigZag(f.type))
+    {
+      return "out.addPackedZigZag(" + packedTag + ", " + element + ", sizes)";
+    }
+    return "out.addPackedVarint(" + packedTag + ", " + element + ", sizes)";
+  }
+  std::string present = f.oneof.empty() ? "" : ", true";
+  if (f.type == "fixed32" || f.type == "sfixed32")
+  {
+    return "out.addInt32(" + tag + ", " + element + present + ")";
+  }
+  else if (f.type == "fixed64" || f.type == "sfixed64")
+  {
+    return "out.addInt64(" + tag + ", " + element + present + ")";
+  }
+  else if (f.type == "string" || f.type == "bytes")
+  {
+    return "out.addLengthDelim(" + tag + ", " + element + present + ")";
+  }
+  else if (f.type == "float")
+  {
+    return "out.addFloat(" + tag + ", " + element + ")";
+  }
+  else if (f.type == "double")
+  {
+    return "out.addDouble(" + tag + ", " + element + ")";
+  }
+  else if (file.isMessage(f.type))
+  {
+    return "out.addMessage(" + tag + ", " + element + ", sizes" + present + ")";
+  }
+  else if (file.isEnum(f.type))
+  {
+    return "out.addVarint(" + tag + ", (uint32_t)" + element + present + ")";
+  }
+  else if (isZigZag(f.type))
+  {
+    return "out.addVarint(" + tag + ", zigzag(" + element + ")" + present + ")";
+  }
+  return "out.addVarint(" + tag + ", " + element + present + ")";
+}
+
+// Emits `statement` for every field, once per element for repeated fields that are not packed
+// and once per entry for maps; a oneof alternative only if it is the one that is set.
+// A field within the first 64 is only visited if its bit is set in `fields`.
+template <typename F>
+static void output_each_field(std::ostream&      os,
+                              ProtoFile&         file,
+                              const std::string& name,
+                              const Message&     message,
+                              F                  statement)
+{
+  for (size_t n = 0; n < message.fields.size(); n++)
+  {
+    auto&       f     = message.fields[n];
+    std::string guard = n < 64 ? "if (fields & " + name + "::Fields::" + f.name + ") " : "";
+    if (!f.oneof.empty())
+    {
+      os << "  " << guard << "if (auto* p = std::get_if<" << f.alternative << ">(&in." << f.oneof
+         << "))\n    " << statement(f, "*p") << ";\n";
+    }
+    else if (f.isMap() || (f.repeated && !file.isPackable(f.type)))
+    {
+      os << "  " << guard << "for (auto& p : in." << f.name << ")\n    " << statement(f, "p")
+         << ";\n";
+    }
+    else
+    {
+      os << "  " << guard << statement(f, "in." + f.name) << ";\n";
+    }
+  }
+}
+
+static void output_byte_size(std::ostream&      os,
+                             ProtoFile&         file,
+                             const std::string& prefix,
+                             Message&           message)
+{
+  std::string name = prefix + message.name;
+  os << "template <>\nsize_t byte_size<" << name << ">(const " << name
+     << "& in, PBSizes* sizes, uint64_t fields) {\n  (void)sizes;\n  size_t size = 0;\n";
+  output_each_field(os, file, name, message,
+                    [&](const Field& f, const std::string& element)
+                    { return "size += " + sizeExpression(file, f, element); });
+  os << "  return size;\n}\n\n";
+}
+
+static void output_encode(std::ostream&      os,
+                          ProtoFile&         file,
+                          const std::string& prefix,
+                          Message&           message)
+{
+  std::string name = prefix + message.name;
+  os << "template <>\nvoid encode<" << name << ">(PBWriter& out, const " << name
+     << "& in, PBSizes& sizes, uint64_t fields) {\n  (void)sizes;\n";
+  output_each_field(os, file, name, message,
+                    [&](const Field& f, const std::string& element)
+                    { return encodeStatement(file, f, element); });
+  os << "}\n\n";
+}
+
 void output_encoder(std::ostream& os, ProtoFile& file)
 {
   os << "#include \"Protobuf.h\"\n\n";
@@ -14,61 +190,31 @@ void output_encoder(std::ostream& os, ProtoFile& file)
   for (auto& [_, message] : file.messages)
   {
     (void)_;
-    os << "template <>\nPBVector to_protobuf<" << prefix << message.name << ">(const " << prefix
-       << message.name << "& in) {\n  PBVector vec;\n";
-    for (auto& f : message.fields)
+    if (file.options.tables)
     {
-      std::string elementName = "in." + f.name;
-      if (f.repeated)
-      {
-        os << "  for (auto& p : " << elementName << ") {\n  ";
-        elementName = "p";
-      }
-
-      if (f.type == "fixed32" || f.type == "sfixed32")
-      {
-        os << "  vec.addInt32(" << f.index << ", " << elementName << ");\n";
-      }
-      else if (f.type == "string")
-      {
-        os << "  vec.addLengthDelim(" << f.index << ", " << elementName << ");\n";
-      }
-      else if (f.type == "bytes")
-      {
-        os << "  vec.addLengthDelim(" << f.index << ", " << elementName << ");\n";
-      }
-      else if (f.type == "float")
-      {
-        os << "  vec.addFloat(" << f.index << ", " << elementName << ");\n";
-      }
-      else if (f.type == "double")
-      {
-        os << "  vec.addDouble(" << f.index << ", " << elementName << ");\n";
-      }
-      else if (std::find_if(file.messages.begin(),
-                            file.messages.end(),
-                            [&](auto a) { return a.first == f.type; })
-                 != file.messages.end()
-               || file.importMessages.find(f.type) != file.importMessages.end())
-      {
-        os << "  vec.addLengthDelim(" << f.index << ", "
-           << "to_protobuf(" << elementName << "));\n";
-      }
-      else if (file.enums.find(f.type) != file.enums.end()
-               || file.importEnums.find(f.type) != file.importEnums.end())
-      {
-        os << "  vec.addVarint(" << f.index << ", (uint32_t)" << elementName << ");\n";
-      }
-      else
-      {
-        os << "  vec.addVarint(" << f.index << ", " << elementName << ");\n";
-      }
-
-      if (f.repeated)
+      std::string table = tableName(message.name, false);
+      std::string name  = prefix + message.name;
+      for (bool projected : { false, true })
       {
-        os << "  }\n";
+        std::string mask = projected ? ", fields" : "";
+        os << "template <>\nsize_t byte_size<" << name << ">(const " << name
+           << "& in, PBSizes* sizes" << (projected ? ", uint64_t fields" : "")
+           << ") {\n  return tableByteSize(" << table << ", &in, sizes" << mask << ");\n}\n\n";
+        os << "template <>\nvoid encode<" << name << ">(PBWriter& out, const " << name
+           << "& in, PBSizes& sizes" << (projected ? ", uint64_t fields" : "")
+           << ") {\n  tableEncode(" << table << ", out, &in, sizes" << mask << ");\n}\n\n";
       }
+      continue;
     }
-    os << "  return vec;\n}\n\n";
+    // The projected pair sizes and writes only the fields selected by a Fields mask; the
+    // parallel encoder uses it for everything but the large repeated fields. The plain pair
+    // passes every field, so only one body is emitted; once inlined the mask tests fold away.
+    std::string name = prefix + message.name;
+    output_byte_size(os, file, prefix, message);
+    output_encode(os, file, prefix, message);
+    os << "template <>\nsize_t byte_size<" << name << ">(const " << name
+       << "& in, PBSizes* sizes) {\n  return byte_size(in, sizes, ~0ULL);\n}\n\n";
+    os << "template <>\nvoid encode<" << name << ">(PBWriter& out, const " << name
+       << "& in, PBSizes& sizes) {\n  encode(out, in, sizes, ~0ULL);\n}\n\n";
   }
 }
@@ -5,18 +5,45 @@
 
 int main(int argc, char** argv)
 {
-  if (argc < 4)
+  GeneratorOptions         options;
+  std::vector<std::string> args;
+  for (int n = 1; n < argc; n++)
   {
-    printf("Usage: %s <proto> <header> <source>\n", argv[0]);
+    std::string arg = argv[n];
+    if (arg == "--pmr")
+    {
+      options.pmr = true;
+    }
+    else if (arg == "--tables")
+    {
+      options.tables = true;
+    }
+    else if (arg == "--reserve")
+    {
+      options.reserve = true;
+    }
+    else if (arg == "--unordered-map")
+    {
+      options.unorderedMap = true;
+    }
+    else
+    {
+      args.push_back(arg);
+    }
+  }
+  if (args.size() < 3)
+  {
+    printf("Usage: %s [--pmr] [--tables] [--reserve] [--unordered-map] <proto> <header> <source>\n", argv[0]);
     exit(-1);
   }
   try
   {
-    std::string baseFolder = argv[1];
+    std::string baseFolder = args[0];
     baseFolder             = baseFolder.substr(0, baseFolder.find_last_of("/"));
-    Lexer     l(readfile(argv[1]));
+    Lexer     l(readfile(args[0]));
     ProtoFile proto = Parser(l).parseProto(baseFolder);
-    write(proto, argv[2], argv[3]);
+    proto.options   = options;
+    write(proto, args[1], args[2]);
   }
   catch (std::exception& e)
   {
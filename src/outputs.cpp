@@ -14,6 +14,10 @@ void write(ProtoFile& file, std::string headerName, std::string codeName)
   }
   std::ofstream code(codeName);
   code << "#include \"" << protoFileName << "\"\n";
+  if (file.options.tables)
+  {
+    output_tables(code, file);
+  }
   output_encoder(code, file);
   output_decoder(code, file);
 }
@@ -7,5 +7,7 @@ std::string toCpp(std::string type);
 void        output_structs(std::ostream& os, ProtoFile& file);
 void        output_encoder(std::ostream& os, ProtoFile& file);
 void        output_decoder(std::ostream& os, ProtoFile& file);
+void        output_tables(std::ostream& os, ProtoFile& file);
+std::string tableName(const std::string& message, bool view);
 
 void write(ProtoFile& file, std::string headerName, std::string codeName);
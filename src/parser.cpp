@@ -2,7 +2,9 @@
 #include "error.h"
 #include "file.h"
 #include "lexer.h"
+#include <limits>
 #include <map>
+#include <set>
 
 struct Reparse
 {
@@ -151,9 +153,14 @@ Message Parser::parseMessage()
       case Type::Enum:
       case Type::Message:
       case Type::Option:
+      case Type::Reserved:
+        skipDeclaration();
+        break;
       case Type::Oneof:
+        parseOneof(message);
+        break;
       case Type::Map:
-      case Type::Reserved:
+        message.fields.push_back(parseMapField());
         break;
       case Type::Semicolon:
         break;
@@ -276,6 +283,11 @@ Field Parser::parseField(Token tok)
     throw Reparse();
   }
   tok = lexer.lex();
+  if (tok.type == Type::LBracket)
+  {
+    parseFieldOptions(f);
+    tok = lexer.lex();
+  }
   if (tok.type != Type::Semicolon)
   {
     ErrorMessage("E", "Found something other than a semicolon terminating a field");
@@ -283,3 +295,123 @@ Field Parser::parseField(Token tok)
   }
   return f;
 }
+
+// Skips the rest of a declaration this generator ignores: up to its semicolon, or to the brace
+// closing its body for a nested message or enum.
+void Parser::skipDeclaration()
+{
+  size_t depth = 0;
+  auto   token = lexer.lex();
+  while (token.type != Type::EndOfFile)
+  {
+    if (token.type == Type::LCurly)
+      depth++;
+    else if (token.type == Type::RCurly && depth > 0 && --depth == 0)
+      return;
+    else if (token.type == Type::Semicolon && depth == 0)
+      return;
+    token = lexer.lex();
+  }
+}
+
+// oneof name { field; ... }; each field is added to the message as one alternative.
+void Parser::parseOneof(Message& message)
+{
+  auto name      = lexer.lex();
+  auto openCurly = lexer.lex();
+  if (name.type != Type::Literal || openCurly.type != Type::LCurly)
+  {
+    ErrorMessage("E", "Oneof declaration does not start with a single name and an open brace");
+    throw Reparse();
+  }
+  size_t alternative = 0;
+  auto   token       = lexer.lex();
+  while (token.type != Type::RCurly)
+  {
+    if (token.type == Type::Option)
+    {
+      while (token.type != Type::Semicolon && token.type != Type::EndOfFile)
+        token = lexer.lex();
+    }
+    else if (token.type != Type::Semicolon)
+    {
+      Field f = parseField(token);
+      if (f.repeated)
+      {
+        ErrorMessage("E", "Oneof fields cannot be repeated");
+        throw Reparse();
+      }
+      f.oneof       = name.text;
+      f.alternative = ++alternative;
+      message.fields.push_back(f);
+    }
+    token = lexer.lex();
+  }
+}
+
+// map<key, value> name = number; the part after the value type is parsed as a plain field.
+Field Parser::parseMapField()
+{
+  static const std::set<std::string> keyTypes = {
+    "bool",     "fixed32", "fixed64", "int32",  "int64",  "sfixed32",
+    "sfixed64", "sint32",  "sint64",  "string", "uint32", "uint64",
+  };
+  auto open  = lexer.lex();
+  auto key   = lexer.lex();
+  auto comma = lexer.lex();
+  if (open.type != Type::LPointy || comma.type != Type::Comma)
+  {
+    ErrorMessage("E", "Expected map<key, value>");
+    throw Reparse();
+  }
+  if (keyTypes.find(key.text) == keyTypes.end())
+  {
+    ErrorMessage("E", "Map keys must be integers, bool or string");
+    throw Reparse();
+  }
+  auto value = lexer.lex();
+  auto close = lexer.lex();
+  if (close.type != Type::RPointy)
+  {
+    ErrorMessage("E", "Expected a closing '>' after the map value type");
+    throw Reparse();
+  }
+  Field f = parseField(value);
+  f.key   = key.text;
+  return f;
+}
+
+void Parser::parseFieldOptions(Field& f)
+{
+  auto tok = lexer.lex();
+  while (tok.type != Type::RBracket)
+  {
+    if (tok.type != Type::Literal)
+    {
+      ErrorMessage("E", "Expected an option name in field options");
+      throw Reparse();
+    }
+    std::string name = tok.text;
+    tok              = lexer.lex();
+    if (tok.type != Type::Equals)
+    {
+      ErrorMessage("E", "No equals sign after field option name");
+      throw Reparse();
+    }
+    auto value = lexer.lex();
+    if (name == "lazy")
+    {
+      f.lazy = value.type == Type::True;
+    }
+    tok = lexer.lex();
+    if (tok.type == Type::Comma)
+    {
+      tok = lexer.lex();
+    }
+    else if (tok.type != Type::RBracket)
+    {
+      ErrorMessage("E", "Expected a comma or closing bracket after field option");
+      throw Reparse();
+    }
+  }
+}
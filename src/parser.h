@@ -17,5 +17,9 @@ private:
   Message                  parseMessage();
   Enum                     parseEnum();
   Field                    parseField(Token tok);
+  Field                    parseMapField();
+  void                     parseOneof(Message& message);
+  void                     parseFieldOptions(Field& f);
+  void                     skipDeclaration();
   std::string              parseImport();
 };
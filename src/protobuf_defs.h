@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <map>
 #include <set>
 #include <string>
@@ -8,9 +9,25 @@
 struct Field
 {
   bool        repeated = false;
+  bool        lazy     = false;
   std::string type;
   std::string name;
   uint32_t    index;
+  // Key type of a map<key, type> field; empty for every other field.
+  std::string key;
+  // Fields of a oneof share one std::variant member named after it, in which this field is
+  // alternative `alternative`; index 0 is std::monostate. The fields of a oneof are adjacent.
+  std::string oneof;
+  size_t      alternative = 0;
+  bool        isMap() const
+  {
+    return !key.empty();
+  }
+  // The struct member holding this field.
+  const std::string& member() const
+  {
+    return oneof.empty() ? name : oneof;
+  }
 };
 struct Message
 {
@@ -22,6 +39,18 @@ struct Enum
   std::string                     name;
   std::map<std::string, uint32_t> values;
 };
+struct GeneratorOptions
+{
+  // Use std::pmr strings and vectors and emit from_protobuf(PBView, std::pmr::memory_resource&).
+  bool pmr = false;
+  // Emit constexpr field tables and let the shared engine in FieldTables.h encode and decode.
+  bool tables = false;
+  // Count the elements of repeated strings, bytes and submessages before decoding, so that each
+  // vector is allocated once at its final size.
+  bool reserve = false;
+  // Generate map fields as std::unordered_map instead of the open-addressing PBFlatMap.
+  bool unorderedMap = false;
+};
 struct ProtoFile
 {
   void addEnum(Enum m)
@@ -52,10 +81,71 @@ struct ProtoFile
       importMessages.insert(name);
     }
   }
+  bool isMessage(const std::string& type) const
+  {
+    return std::find_if(messages.begin(),
+                        messages.end(),
+                        [&](auto& a) { return a.first == type; })
+             != messages.end()
+           || importMessages.find(type) != importMessages.end();
+  }
+  bool isEnum(const std::string& type) const
+  {
+    return enums.find(type) != enums.end() || importEnums.find(type) != importEnums.end();
+  }
+  // Scalar numeric, bool and enum fields; repeated fields of these types are packed.
+  bool isPackable(const std::string& type) const
+  {
+    return type != "string" && type != "bytes" && !isMessage(type);
+  }
+  // [lazy = true] only has an effect on submessage fields.
+  bool isLazy(const Field& f) const
+  {
+    return f.lazy && !f.isMap() && f.oneof.empty() && isMessage(f.type);
+  }
+  // Name of the runtime wiretype constant for a single (unpacked) value of this type.
+  std::string wireType(const std::string& type) const
+  {
+    if (type == "fixed32" || type == "sfixed32" || type == "float")
+      return "U32";
+    if (type == "fixed64" || type == "sfixed64" || type == "double")
+      return "U64";
+    if (type == "string" || type == "bytes" || isMessage(type))
+      return "Delim";
+    return "Varint";
+  }
+  // Map fields are written as repeated entry messages.
+  std::string wireType(const Field& f) const
+  {
+    return f.isMap() ? "Delim" : wireType(f.type);
+  }
+  // The pbtag<> constant the generated code uses for this field.
+  std::string tagFor(const Field& f, bool packed = false) const
+  {
+    return "pbtag<" + std::to_string(f.index) + ", " + (packed ? "Delim" : wireType(f)) + ">";
+  }
+  // The key and value of a map field as the fields 1 and 2 of its entry message.
+  static Field mapKey(const Field& f)
+  {
+    Field key;
+    key.type  = f.key;
+    key.name  = "key";
+    key.index = 1;
+    return key;
+  }
+  static Field mapValue(const Field& f)
+  {
+    Field value;
+    value.type  = f.type;
+    value.name  = "value";
+    value.index = 2;
+    return value;
+  }
   std::map<std::string, Enum>                  enums;
   std::vector<std::pair<std::string, Message>> messages;
   std::vector<std::string>                     package;
   std::vector<std::string>                     imports;
   std::set<std::string>                        importEnums;
   std::set<std::string>                        importMessages;
+  GeneratorOptions                             options;
 };
@@ -3,10 +3,236 @@
 #include "toCpp.h"
 #include <iostream>
 
+// Views hold string and bytes fields as views into the buffer they were decoded from, and
+// submessages as views of their own.
+static std::string toCppView(ProtoFile& file, const std::string& type)
+{
+  if (type == "string")
+  {
+    return "std::string_view";
+  }
+  else if (type == "bytes")
+  {
+    return "std::span<const uint8_t>";
+  }
+  else if (file.isMessage(type))
+  {
+    return type + "View";
+  }
+  return toCpp(type);
+}
+
+static std::string toCppPmr(const std::string& type)
+{
+  if (type == "string")
+  {
+    return "std::pmr::string";
+  }
+  else if (type == "bytes")
+  {
+    return "std::pmr::vector<uint8_t>";
+  }
+  return toCpp(type);
+}
+
+static bool isAllocatorAware(ProtoFile& file, const Field& f)
+{
+  return f.repeated || f.isMap() || f.type == "string" || f.type == "bytes"
+         || (file.isMessage(f.type) && !file.isLazy(f));
+}
+
+// Allocator-extended constructors, so that pmr containers of this type hand their memory
+// resource down to every nested string and vector.
+static void output_pmr_constructors(std::ostream& os, ProtoFile& file, const Message& message)
+{
+  const std::string& name = message.name;
+  os << "  using allocator_type = std::pmr::polymorphic_allocator<>;\n";
+  os << "  " << name << "() = default;\n";
+  os << "  " << name << "(const " << name << "&) = default;\n";
+  os << "  " << name << "(" << name << "&&) = default;\n";
+  os << "  " << name << "& operator=(const " << name << "&) = default;\n";
+  os << "  " << name << "& operator=(" << name << "&&) = default;\n";
+  std::string init, copy, move;
+  for (auto& f : message.fields)
+  {
+    // A oneof is one member; std::variant does not take an allocator.
+    if (f.alternative > 1)
+    {
+      continue;
+    }
+    const std::string& m         = f.member();
+    std::string        separator = copy.empty() ? "\n    : " : "\n    , ";
+    if (f.oneof.empty() && isAllocatorAware(file, f))
+    {
+      init += (init.empty() ? "\n    : " : "\n    , ") + m + "(alloc)";
+      copy += separator + m + "(other." + m + ", alloc)";
+      move += separator + m + "(std::move(other." + m + "), alloc)";
+    }
+    else
+    {
+      copy += separator + m + "(other." + m + ")";
+      move += separator + m + "(std::move(other." + m + "))";
+    }
+  }
+  std::string alloc = init.empty() ? "" : " alloc";
+  std::string other = copy.empty() ? "" : " other";
+  os << "  explicit " << name << "(const allocator_type&" << alloc << ")" << init << " {}\n";
+  os << "  " << name << "(const " << name << "&" << other << ", const allocator_type&" << alloc
+     << ")" << copy << " {}\n";
+  os << "  " << name << "(" << name << "&&" << other << ", const allocator_type&" << alloc << ")"
+     << move << " {}\n";
+}
+
+// PBFlatMap by default, std::unordered_map with --unordered-map. View keys are string_views.
+static std::string mapType(ProtoFile& file, const Field& f, bool view, bool pmr)
+{
+  std::string key   = view ? toCppView(file, f.key) : pmr ? toCppPmr(f.key) : toCpp(f.key);
+  std::string value = view ? toCppView(file, f.type) : pmr ? toCppPmr(f.type) : toCpp(f.type);
+  if (file.options.unorderedMap)
+  {
+    return (pmr ? "std::pmr::unordered_map<" : "std::unordered_map<") + key + ", " + value + ">";
+  }
+  return (pmr ? "PBPmrFlatMap<" : "PBFlatMap<") + key + ", " + value + ">";
+}
+
+static void output_struct(std::ostream& os, ProtoFile& file, const Message& message, bool view)
+{
+  bool pmr = file.options.pmr && !view;
+  if (view)
+  {
+    os << "// Zero-copy view of " << message.name
+       << "; only valid while the buffer it was decoded from is alive.\n";
+  }
+  os << "struct " << message.name << (view ? "View" : "") << " {\n";
+  if (pmr)
+  {
+    output_pmr_constructors(os, file, message);
+  }
+  if (!message.fields.empty())
+  {
+    // Fields past the 64th have no bit and are always decoded.
+    os << "  // One bit per field in declaration order, for from_protobuf(data, fields).\n";
+    os << "  struct Fields {\n";
+    for (size_t n = 0; n < message.fields.size() && n < 64; n++)
+    {
+      os << "    static constexpr uint64_t " << message.fields[n].name << " = 1ULL << " << n
+         << ";\n";
+    }
+    // A oneof's mask selects all of its alternatives.
+    for (size_t n = 0; n < message.fields.size() && n < 64; n++)
+    {
+      auto& f = message.fields[n];
+      if (f.alternative != 1)
+      {
+        continue;
+      }
+      os << "    static constexpr uint64_t " << f.oneof << " = ";
+      for (size_t a = n; a < message.fields.size() && a < 64 && message.fields[a].oneof == f.oneof;
+           a++)
+      {
+        os << (a == n ? "" : " | ") << message.fields[a].name;
+      }
+      os << ";\n";
+    }
+    os << "  };\n";
+  }
+  auto typeOf = [&](const Field& f)
+  {
+    std::string type = view ? toCppView(file, f.type) : pmr ? toCppPmr(f.type) : toCpp(f.type);
+    return file.isLazy(f) ? "Lazy<" + type + ">" : type;
+  };
+  for (size_t n = 0; n < message.fields.size(); n++)
+  {
+    auto&       f    = message.fields[n];
+    std::string type = typeOf(f);
+    if (!f.oneof.empty())
+    {
+      // Only as large as the largest alternative, where separate fields would hold all of them.
+      if (f.alternative == 1)
+      {
+        os << "  std::variant<std::monostate";
+        for (size_t a = n; a < message.fields.size() && message.fields[a].oneof == f.oneof; a++)
+        {
+          os << ", " << typeOf(message.fields[a]);
+        }
+        os << "> " << f.oneof << ";\n";
+      }
+    }
+    else if (f.isMap())
+    {
+      os << "  " << mapType(file, f, view, pmr) << " " << f.name << ";\n";
+    }
+    else if (f.repeated)
+    {
+      os << "  " << (pmr ? "std::pmr::vector<" : "std::vector<") << type << "> " << f.name << ";\n";
+    }
+    else
+    {
+      os << "  " << type << " " << f.name;
+      if (file.enums.find(f.type) != file.enums.end())
+      {
+        auto& e = file.enums.find(f.type)->second;
+        for (auto& [name, value] : e.values)
+        {
+          if (value == 0)
+          {
+            os << " = " << f.type << "::" << name;
+            break;
+          }
+        }
+      }
+      else if (f.type == "string" || f.type == "bytes")
+      {
+      }
+      else if (f.type == "float")
+      {
+        os << " = 0.0f";
+      }
+      else if (f.type == "bool")
+      {
+        os << " = false";
+      }
+      else if (f.type == "double")
+      {
+        os << " = 0.0";
+      }
+      else if (toCpp(f.type) != f.type)
+      {
+        os << " = 0";
+      }
+
+      os << ";\n";
+    }
+  }
+  os << "};\n\n";
+}
+
 void output_structs(std::ostream& os, ProtoFile& file)
 {
-  os << "#pragma once\n\n#include \"Protobuf.h\"\n#include <cstdint>\n#include <string>\n#include "
-        "<vector>\n";
+  os << "#pragma once\n\n#include \"Protobuf.h\"\n#include <cstdint>\n#include <span>\n#include "
+        "<string>\n#include <string_view>\n#include <vector>\n";
+  bool maps = false;
+  for (auto& [_, message] : file.messages)
+  {
+    (void)_;
+    maps = maps || std::any_of(message.fields.begin(), message.fields.end(),
+                               [](const Field& f) { return f.isMap(); });
+  }
+  if (maps)
+  {
+    os << (file.options.unorderedMap ? "#include <unordered_map>\n" : "#include \"FlatMap.h\"\n");
+  }
+  bool oneofs = false;
+  for (auto& [_, message] : file.messages)
+  {
+    (void)_;
+    oneofs = oneofs || std::any_of(message.fields.begin(), message.fields.end(),
+                                   [](const Field& f) { return !f.oneof.empty(); });
+  }
+  if (oneofs)
+  {
+    os << "#include <variant>\n";
+  }
 
   for (auto& import : file.imports)
   {
@@ -32,52 +258,8 @@ void output_structs(std::ostream& os, ProtoFile& file)
   for (auto& [_, message] : file.messages)
   {
     (void)_;
-    os << "struct " << message.name << " {\n";
-    for (auto& f : message.fields)
-    {
-      if (f.repeated)
-      {
-        os << "  std::vector<" << toCpp(f.type) << "> " << f.name << ";\n";
-      }
-      else
-      {
-        os << "  " << toCpp(f.type) << " " << f.name;
-        if (file.enums.find(f.type) != file.enums.end())
-        {
-          auto& e = file.enums.find(f.type)->second;
-          for (auto& [name, value] : e.values)
-          {
-            if (value == 0)
-            {
-              os << " = " << f.type << "::" << name;
-              break;
-            }
-          }
-        }
-        else if (f.type == "string" || f.type == "bytes")
-        {
-        }
-        else if (f.type == "float")
-        {
-          os << " = 0.0f";
-        }
-        else if (f.type == "bool")
-        {
-          os << " = false";
-        }
-        else if (f.type == "double")
-        {
-          os << " = 0.0";
-        }
-        else if (toCpp(f.type) != f.type)
-        {
-          os << " = 0";
-        }
-
-        os << ";\n";
-      }
-    }
-    os << "};\n\n";
+    output_struct(os, file, message, false);
+    output_struct(os, file, message, true);
   }
   for (auto& _ : file.package)
   {
@@ -98,4 +280,43 @@ void output_structs(std::ostream& os, ProtoFile& file)
     os << "template <> inline constexpr bool is_protobuf<" << prefix << message.name
        << "> = true;\n";
   }
+  // Field numbers, wire types and projection bits by member, for pb_get() and the parallel
+  // decoder.
+  for (auto& [_, message] : file.messages)
+  {
+    (void)_;
+    for (size_t n = 0; n < message.fields.size(); n++)
+    {
+      auto&       f    = message.fields[n];
+      std::string name = prefix + message.name;
+      // The alternatives of a oneof share a member, so none of them has its own entry.
+      if (!f.oneof.empty())
+      {
+        continue;
+      }
+      os << "template <> inline constexpr PBMember pbMember<&" << name << "::" << f.name
+         << "> = { " << f.index << ", " << file.wireType(f) << ", "
+         << (isZigZag(f.type) ? "true" : "false") << ", "
+         << (n < 64 ? name + "::Fields::" + f.name : "0") << " };\n";
+    }
+  }
+  // Repeated submessages that from_protobuf_parallel() may decode across threads. It skips them
+  // with a projected decode, so only fields that have a projection bit qualify.
+  for (auto& [_, message] : file.messages)
+  {
+    (void)_;
+    std::string members;
+    for (size_t n = 0; n < message.fields.size() && n < 64; n++)
+    {
+      auto& f = message.fields[n];
+      if (f.repeated && file.isMessage(f.type) && !file.isLazy(f))
+        members += std::string(members.empty() ? "" : ", ") + "&" + prefix + message.name
+                   + "::" + f.name;
+    }
+    if (!members.empty())
+    {
+      os << "template <> inline constexpr auto pbRepeatedMessages<" << prefix << message.name
+         << "> = std::tuple{ " << members << " };\n";
+    }
+  }
 }
@@ -0,0 +1,107 @@
+#include "outputs.h"
+#include "protobuf_defs.h"
+#include <iostream>
+
+static std::string kindFor(ProtoFile& file, const std::string& type)
+{
+  static const std::map<std::string, std::string> kinds = {
+    { "bool", "Bool" },         { "bytes", "Bytes" },       { "double", "Double" },
+    { "fixed32", "Fixed32" },   { "fixed64", "Fixed64" },   { "float", "Float" },
+    { "int32", "Int32" },       { "int64", "Int64" },       { "sfixed32", "SFixed32" },
+    { "sfixed64", "SFixed64" }, { "sint32", "SInt32" },     { "sint64", "SInt64" },
+    { "string", "String" },     { "uint32", "UInt32" },     { "uint64", "UInt64" },
+  };
+  if (auto it = kinds.find(type); it != kinds.end())
+  {
+    return it->second;
+  }
+  return file.isMessage(type) ? "Message" : "Enum";
+}
+
+// Only messages from this file have a table here; imported ones go through their from_protobuf.
+static bool hasTable(ProtoFile& file, const std::string& type)
+{
+  for (auto& [name, _] : file.messages)
+  {
+    (void)_;
+    if (name == type)
+      return true;
+  }
+  return false;
+}
+
+std::string tableName(const std::string& message, bool view)
+{
+  return "pbTable_" + message + (view ? "View" : "");
+}
+
+static void output_table(std::ostream&      os,
+                         ProtoFile&         file,
+                         const std::string& prefix,
+                         const Message&     message,
+                         bool               view)
+{
+  std::string name = tableName(message.name, view);
+  std::string type = prefix + message.name + (view ? "View" : "");
+  if (message.fields.empty())
+  {
+    os << "constexpr PBMessageTable " << name << " = { nullptr, 0 };\n\n";
+    return;
+  }
+  os << "constexpr PBField " << name << "_fields[] = {\n";
+  for (auto& f : message.fields)
+  {
+    std::string kind   = kindFor(file, f.type);
+    bool        nested = hasTable(file, f.type) && !file.isLazy(f) && !f.isMap() && f.oneof.empty();
+    os << "  { " << f.index << ", " << file.wireType(f) << ", PBKind::" << kind << ", offsetof("
+       << type << ", " << f.member() << "), ";
+    os << (nested ? "&" + tableName(f.type, view) : "nullptr");
+    // Every alternative of a oneof has its own entry, pointing at the shared std::variant.
+    if (!f.oneof.empty())
+    {
+      os << (view ? ", &pbViewOneofOps<PBKind::" : ", &pbOneofOps<PBKind::") << kind << ", "
+         << f.alternative << ", decltype(" << type << "::" << f.oneof << ")>";
+    }
+    else if (f.isMap())
+    {
+      os << (view ? ", &pbViewMapOps<PBKind::" : ", &pbMapOps<PBKind::") << kindFor(file, f.key)
+         << ", PBKind::" << kind << ", decltype(" << type << "::" << f.name << ")>";
+    }
+    // Singular scalars and submessages with a table are handled inline by the engine.
+    else if (f.repeated || kind == "String" || kind == "Bytes" || (kind == "Message" && !nested))
+    {
+      os << (view ? ", &pbViewFieldOps<PBKind::" : ", &pbFieldOps<PBKind::") << kind << ", "
+         << (f.repeated ? "true" : "false") << ", decltype(" << type << "::" << f.name << ")>";
+    }
+    os << " },\n";
+  }
+  os << "};\nconstexpr PBMessageTable " << name << " = { " << name << "_fields, "
+     << message.fields.size() << " };\n\n";
+}
+
+void output_tables(std::ostream& os, ProtoFile& file)
+{
+  os << "#include \"FieldTables.h\"\n#include <cstddef>\n\n";
+  std::string prefix;
+  for (auto& segment : file.package)
+  {
+    prefix += segment + "::";
+  }
+  // offsetof on structs holding std::string and friends is only conditionally supported, but
+  // GCC and Clang handle it for these non-virtual aggregates.
+  os << "#pragma GCC diagnostic ignored \"-Winvalid-offsetof\"\n\nnamespace {\n\n";
+  for (auto& [_, message] : file.messages)
+  {
+    (void)_;
+    os << "extern const PBMessageTable " << tableName(message.name, false) << ";\n";
+    os << "extern const PBMessageTable " << tableName(message.name, true) << ";\n";
+  }
+  os << "\n";
+  for (auto& [_, message] : file.messages)
+  {
+    (void)_;
+    output_table(os, file, prefix, message, false);
+    output_table(os, file, prefix, message, true);
+  }
+  os << "}\n\n";
+}
@@ -20,3 +20,18 @@ std::string toCpp(std::string type)
   }
   return type;
 }
+
+bool isFixed32(const std::string& type)
+{
+  return type == "fixed32" || type == "sfixed32" || type == "float";
+}
+
+bool isFixed64(const std::string& type)
+{
+  return type == "fixed64" || type == "sfixed64" || type == "double";
+}
+
+bool isZigZag(const std::string& type)
+{
+  return type == "sint32" || type == "sint64";
+}
@@ -3,3 +3,6 @@
 #include <string>
 
 std::string toCpp(std::string type);
+bool        isFixed32(const std::string& type);
+bool        isFixed64(const std::string& type);
+bool        isZigZag(const std::string& type);
@@ -0,0 +1,958 @@
+#pragma once
+
+#include "Protobuf.h"
+
+// Table-driven codec used by code generated with --tables. Instead of one switch per message,
+// the generator emits a constexpr table of field descriptors and the byte_size, encode and
+// from_protobuf specializations hand it to the shared engine below. Singular scalars and
+// submessages from the same file are handled inline from the member offset; everything else
+// goes through the field's PBFieldOps, instantiated from pbFieldOps.
+
+enum class PBKind : uint8_t
+{
+  Int32,
+  Int64,
+  UInt32,
+  UInt64,
+  SInt32,
+  SInt64,
+  Bool,
+  Enum,
+  Fixed32,
+  SFixed32,
+  Fixed64,
+  SFixed64,
+  Float,
+  Double,
+  String,
+  Bytes,
+  Message
+};
+
+struct PBField;
+
+struct PBMessageTable
+{
+  const PBField* fields;
+  size_t         count;
+};
+
+// Handles a whole member: repeated fields, maps, strings and bytes, and lazy or imported
+// submessages; or one alternative of a oneof.
+struct PBFieldOps
+{
+  void (*decode)(const PBField& field, void* member, PBView::iterator& entry);
+  size_t (*size)(const PBField& field, const void* member, PBSizes* sizes);
+  void (*encode)(const PBField& field, PBWriter& out, const void* member, PBSizes& sizes);
+  // For decode_into(): `used` counts the occurrences decoded so far, and elements of repeated
+  // strings, bytes and submessages up to it are reused; finish() then drops the rest.
+  void (*decodeInto)(const PBField& field, void* member, PBView::iterator& entry, size_t& used);
+  void (*finish)(const PBField& field, void* member, size_t used);
+  // Reserves room for `count` elements; only set for maps and repeated fields that are not packed.
+  void (*reserve)(void* member, size_t count);
+};
+
+struct PBField
+{
+  uint32_t              number;
+  wiretype              type;
+  PBKind                kind;
+  size_t                offset;
+  const PBMessageTable* nested = nullptr;
+  const PBFieldOps*     ops    = nullptr;
+  PBTag                 tag    = PBTag(number, type);
+};
+
+inline size_t tableByteSize(const PBMessageTable& table,
+                            const void*           in,
+                            PBSizes*              sizes,
+                            uint64_t              fields = ~0ULL);
+inline void   tableEncode(const PBMessageTable& table,
+                          PBWriter&             out,
+                          const void*           in,
+                          PBSizes&              sizes,
+                          uint64_t              fields = ~0ULL);
+inline void tableDecode(const PBMessageTable& table,
+                        void*                 out,
+                        PBView                data,
+                        uint64_t              fields = ~0ULL);
+inline void tableDecodeInto(const PBMessageTable& table, void* out, PBView data);
+inline void tableReserve(const PBMessageTable& table, void* out, PBView data);
+
+template <typename T>
+struct PBIsLazy : std::false_type
+{
+};
+template <typename T>
+struct PBIsLazy<Lazy<T>> : std::true_type
+{
+};
+
+template <bool Repeated, typename M>
+struct PBElement
+{
+  using type = M;
+};
+template <typename M>
+struct PBElement<true, M>
+{
+  using type = typename M::value_type;
+};
+
+template <PBKind Kind, bool Repeated, typename M>
+struct PBFieldCodec
+{
+  using T = typename PBElement<Repeated, M>::type;
+
+  static constexpr bool packable = Kind != PBKind::String && Kind != PBKind::Bytes
+                                   && Kind != PBKind::Message;
+  static constexpr bool fixed    = Kind == PBKind::Fixed32 || Kind == PBKind::SFixed32
+                                || Kind == PBKind::Fixed64 || Kind == PBKind::SFixed64
+                                || Kind == PBKind::Float || Kind == PBKind::Double;
+  static constexpr bool zigzag   = Kind == PBKind::SInt32 || Kind == PBKind::SInt64;
+  // Owned strings and bytes and non-lazy submessages are decoded over by decode_into().
+  static constexpr bool reused   = Kind == PBKind::Message
+                                   ? !PBIsLazy<T>::value
+                                   : (Kind == PBKind::String || Kind == PBKind::Bytes)
+                                       && !std::is_same_v<T, std::string_view>
+                                       && !std::is_same_v<T, std::span<const uint8_t>>;
+
+  // The first tag byte holds the wire type, so the packed tag only differs in its low bits.
+  static PBTag packedTag(const PBField& field)
+  {
+    PBTag tag = field.tag;
+    tag.bytes = (tag.bytes & ~7ULL) | Delim;
+    return tag;
+  }
+  static T read(PBView::iterator& entry)
+  {
+    if constexpr (zigzag)
+      return (T)unzigzag(entry.read());
+    else if constexpr (Kind == PBKind::Float || Kind == PBKind::Double)
+      return (T)entry.readDouble();
+    else
+      return (T)entry.read();
+  }
+  static void decode(const PBField& field, void* member, PBView::iterator& entry)
+  {
+    M& m = *(M*)member;
+    if constexpr (Repeated && packable)
+    {
+      if (entry.tag == packedTag(field).bytes)
+      {
+        if constexpr (fixed)
+          entry.readPackedFixed(m);
+        else if constexpr (zigzag)
+          entry.readPackedZigZag(m);
+        else
+          entry.readPackedVarint(m);
+        return;
+      }
+    }
+    if (entry.tag != field.tag.bytes)
+      return;
+    if constexpr (Kind == PBKind::String)
+    {
+      if constexpr (Repeated)
+        m.emplace_back((const char*)entry.data_, entry.length);
+      else if constexpr (std::is_same_v<T, std::string_view>)
+        m = entry.readStringView();
+      else
+        m.assign((const char*)entry.data_, entry.length);
+    }
+    else if constexpr (Kind == PBKind::Bytes)
+    {
+      if constexpr (Repeated)
+        m.emplace_back(entry.data_, entry.data_ + entry.length);
+      else if constexpr (std::is_same_v<T, std::span<const uint8_t>>)
+        m = entry.readBytesView();
+      else
+        m.assign(entry.data_, entry.data_ + entry.length);
+    }
+    else if constexpr (Kind == PBKind::Message && PBIsLazy<T>::value)
+    {
+      if constexpr (Repeated)
+        m.emplace_back(entry.pbview());
+      else
+        m.merge(entry.pbview());
+    }
+    else if constexpr (Kind == PBKind::Message)
+    {
+      // Submessages from this file are decoded in place, so pmr elements keep their resource.
+      if constexpr (Repeated)
+      {
+        if (field.nested)
+          tableDecode(*field.nested, &m.emplace_back(), entry.pbview());
+        else
+          m.push_back(from_protobuf<T>(entry.pbview()));
+      }
+      else
+      {
+        merge_from_protobuf(entry.pbview(), m);
+      }
+    }
+    else if constexpr (Repeated)
+    {
+      m.push_back(read(entry));
+    }
+    else
+    {
+      m = read(entry);
+    }
+  }
+  static void decodeInto(const PBField& field, void* member, PBView::iterator& entry, size_t& used)
+  {
+    M& m = *(M*)member;
+    if constexpr (reused)
+    {
+      if (entry.tag != field.tag.bytes)
+        return;
+      T*   value = nullptr;
+      bool again = false;
+      if constexpr (Repeated)
+        value = &pbNext(m, used);
+      else
+        value = &m, again = used, used = 1;
+      if constexpr (Kind == PBKind::String)
+        entry.readStringInto(*value);
+      else if constexpr (Kind == PBKind::Bytes)
+        entry.readBytesInto(*value);
+      // A singular submessage that occurs again is merged into, as in tableDecode().
+      else if (again && field.nested)
+        tableDecode(*field.nested, value, entry.pbview());
+      else if (again)
+        merge_from_protobuf(entry.pbview(), *value);
+      else if (field.nested)
+        tableDecodeInto(*field.nested, value, entry.pbview());
+      else
+        decode_into(entry.pbview(), *value);
+    }
+    else
+    {
+      // Repeated fields are appended to and lazy submessages merged into, so they are emptied
+      // before the first occurrence.
+      if constexpr (Repeated)
+      {
+        if (!used)
+          m.clear();
+      }
+      else if constexpr (Kind == PBKind::Message)
+      {
+        if (!used)
+          m = M{};
+      }
+      used++;
+      decode(field, member, entry);
+    }
+  }
+  static void finish(const PBField& field, void* member, size_t used)
+  {
+    M& m = *(M*)member;
+    if constexpr (Repeated && reused)
+      m.resize(used);
+    else if constexpr (Repeated)
+    {
+      if (!used)
+        m.clear();
+    }
+    else if (used)
+      return;
+    else if constexpr (Kind == PBKind::Message && reused)
+    {
+      if (field.nested)
+        tableDecodeInto(*field.nested, &m, PBView(nullptr, 0));
+      else
+        decode_into(PBView(nullptr, 0), m);
+    }
+    else if constexpr (reused)
+      m.clear();
+    else
+      m = M{};
+  }
+  static void reserve(void* member, size_t count)
+  {
+    ((M*)member)->reserve(count);
+  }
+  using Reserve = void (*)(void* member, size_t count);
+  static constexpr Reserve reserver()
+  {
+    if constexpr (Repeated && !packable)
+      return &reserve;
+    else
+      return nullptr;
+  }
+  static size_t sizeOne(const PBField& field, const T& value, PBSizes* sizes)
+  {
+    if constexpr (Kind == PBKind::Message && !PBIsLazy<T>::value)
+    {
+      if (field.nested)
+      {
+        size_t size;
+        if (sizes)
+        {
+          size_t slot = sizes->open();
+          size        = tableByteSize(*field.nested, &value, sizes);
+          sizes->close(slot, size);
+        }
+        else
+        {
+          size = tableByteSize(*field.nested, &value, nullptr);
+        }
+        return size ? field.tag.size + varintSize(size) + size : 0;
+      }
+      return sizeMessage(field.tag, value, sizes);
+    }
+    else if constexpr (Kind == PBKind::Message)
+      return sizeMessage(field.tag, value, sizes);
+    else
+      return sizeLengthDelim(field.tag, value);
+  }
+  static size_t size(const PBField& field, const void* member, PBSizes* sizes)
+  {
+    const M& m = *(const M*)member;
+    if constexpr (Repeated && packable)
+    {
+      if constexpr (fixed)
+        return sizePackedFixed(packedTag(field), m);
+      else if constexpr (zigzag)
+        return sizePackedZigZag(packedTag(field), m, sizes);
+      else
+        return sizePackedVarint(packedTag(field), m, sizes);
+    }
+    else if constexpr (Repeated)
+    {
+      size_t size = 0;
+      for (auto& value : m)
+        size += sizeOne(field, value, sizes);
+      return size;
+    }
+    else
+    {
+      return sizeOne(field, m, sizes);
+    }
+  }
+  static void encodeOne(const PBField& field, PBWriter& out, const T& value, PBSizes& sizes)
+  {
+    if constexpr (Kind == PBKind::Message && !PBIsLazy<T>::value)
+    {
+      if (field.nested)
+      {
+        size_t size = sizes.pop();
+        if (size == 0)
+          return;
+        out.writeTag(field.tag);
+        out.writeVarint(size);
+        tableEncode(*field.nested, out, &value, sizes);
+        return;
+      }
+      out.addMessage(field.tag, value, sizes);
+    }
+    else if constexpr (Kind == PBKind::Message)
+      out.addMessage(field.tag, value, sizes);
+    else
+      out.addLengthDelim(field.tag, value);
+  }
+  static void encode(const PBField& field, PBWriter& out, const void* member, PBSizes& sizes)
+  {
+    const M& m = *(const M*)member;
+    if constexpr (Repeated && packable)
+    {
+      if constexpr (fixed)
+        out.addPackedFixed(packedTag(field), m);
+      else if constexpr (zigzag)
+        out.addPackedZigZag(packedTag(field), m, sizes);
+      else
+        out.addPackedVarint(packedTag(field), m, sizes);
+    }
+    else if constexpr (Repeated)
+    {
+      for (auto& value : m)
+        encodeOne(field, out, value, sizes);
+    }
+    else
+    {
+      encodeOne(field, out, m, sizes);
+    }
+  }
+};
+
+template <PBKind Kind, bool Repeated, typename M>
+inline constexpr PBFieldOps pbFieldOps = { &PBFieldCodec<Kind, Repeated, M>::decode,
+                                           &PBFieldCodec<Kind, Repeated, M>::size,
+                                           &PBFieldCodec<Kind, Repeated, M>::encode,
+                                           &PBFieldCodec<Kind, Repeated, M>::decodeInto,
+                                           &PBFieldCodec<Kind, Repeated, M>::finish,
+                                           PBFieldCodec<Kind, Repeated, M>::reserver() };
+
+// Views are only ever decoded.
+template <PBKind Kind, bool Repeated, typename M>
+inline constexpr PBFieldOps pbViewFieldOps = { &PBFieldCodec<Kind, Repeated, M>::decode,
+                                               nullptr,
+                                               nullptr,
+                                               &PBFieldCodec<Kind, Repeated, M>::decodeInto,
+                                               &PBFieldCodec<Kind, Repeated, M>::finish,
+                                               PBFieldCodec<Kind, Repeated, M>::reserver() };
+
+constexpr wiretype pbWireType(PBKind kind)
+{
+  switch (kind)
+  {
+    case PBKind::Fixed32:
+    case PBKind::SFixed32:
+    case PBKind::Float:
+      return U32;
+    case PBKind::Fixed64:
+    case PBKind::SFixed64:
+    case PBKind::Double:
+      return U64;
+    case PBKind::String:
+    case PBKind::Bytes:
+    case PBKind::Message:
+      return Delim;
+    default:
+      return Varint;
+  }
+}
+
+inline size_t tableSizeScalar(const PBField& field, const void* m, bool addEvenIfZero = false);
+inline void   tableEncodeScalar(const PBField& field,
+                                PBWriter&       out,
+                                const void*     m,
+                                bool            addEvenIfZero = false);
+inline void   tableDecodeScalar(const PBField& field, void* m, PBView::iterator& entry);
+
+// Map fields. Each entry is a message with the key as field 1 and the value as field 2, and each
+// of those is handled like a singular field of its kind.
+template <PBKind KeyKind, PBKind ValueKind, typename M>
+struct PBMapCodec
+{
+  using K = typename M::key_type;
+  using V = typename M::mapped_type;
+
+  static constexpr PBField keyField   = { 1, pbWireType(KeyKind), KeyKind, 0 };
+  static constexpr PBField valueField = { 2, pbWireType(ValueKind), ValueKind, 0 };
+
+  // Key and value come from pbReadMapEntry() built with the map's allocator, so submessages are
+  // decoded into them rather than assigned.
+  template <PBKind Kind, typename T>
+  static void decodePart(const PBField& field, T& part, PBView::iterator& entry)
+  {
+    if constexpr (Kind == PBKind::Message)
+    {
+      if (entry.tag == field.tag.bytes)
+        decode_into(entry.pbview(), part);
+    }
+    else if constexpr (pbWireType(Kind) == Delim)
+      PBFieldCodec<Kind, false, T>::decode(field, &part, entry);
+    else if (entry.tag == field.tag.bytes)
+      tableDecodeScalar(field, &part, entry);
+  }
+  template <PBKind Kind, typename T>
+  static size_t sizePart(const PBField& field, const T& part, PBSizes* sizes)
+  {
+    if constexpr (pbWireType(Kind) == Delim)
+      return PBFieldCodec<Kind, false, T>::size(field, &part, sizes);
+    else
+      return tableSizeScalar(field, &part);
+  }
+  template <PBKind Kind, typename T>
+  static void encodePart(const PBField& field, PBWriter& out, const T& part, PBSizes& sizes)
+  {
+    if constexpr (pbWireType(Kind) == Delim)
+      PBFieldCodec<Kind, false, T>::encode(field, out, &part, sizes);
+    else
+      tableEncodeScalar(field, out, &part);
+  }
+  static void decode(const PBField& field, void* member, PBView::iterator& entry)
+  {
+    if (entry.tag != field.tag.bytes)
+      return;
+    pbReadMapEntry(*(M*)member,
+                   entry.pbview(),
+                   [](PBView::iterator& part, K& key, V& value)
+                   {
+                     decodePart<KeyKind>(keyField, key, part);
+                     decodePart<ValueKind>(valueField, value, part);
+                   });
+  }
+  static void decodeInto(const PBField& field, void* member, PBView::iterator& entry, size_t& used)
+  {
+    if (!used++)
+      ((M*)member)->clear();
+    decode(field, member, entry);
+  }
+  static void finish(const PBField&, void* member, size_t used)
+  {
+    if (!used)
+      ((M*)member)->clear();
+  }
+  static void reserve(void* member, size_t count)
+  {
+    ((M*)member)->reserve(count);
+  }
+  static size_t size(const PBField& field, const void* member, PBSizes* sizes)
+  {
+    size_t size = 0;
+    for (auto& entry : *(const M*)member)
+    {
+      size += sizeMapEntry(field.tag,
+                           sizes,
+                           [&]
+                           {
+                             return sizePart<KeyKind>(keyField, entry.first, sizes)
+                                    + sizePart<ValueKind>(valueField, entry.second, sizes);
+                           });
+    }
+    return size;
+  }
+  static void encode(const PBField& field, PBWriter& out, const void* member, PBSizes& sizes)
+  {
+    for (auto& entry : *(const M*)member)
+    {
+      out.addMapEntry(field.tag,
+                      sizes,
+                      [&]
+                      {
+                        encodePart<KeyKind>(keyField, out, entry.first, sizes);
+                        encodePart<ValueKind>(valueField, out, entry.second, sizes);
+                      });
+    }
+  }
+};
+
+template <PBKind KeyKind, PBKind ValueKind, typename M>
+inline constexpr PBFieldOps pbMapOps = { &PBMapCodec<KeyKind, ValueKind, M>::decode,
+                                         &PBMapCodec<KeyKind, ValueKind, M>::size,
+                                         &PBMapCodec<KeyKind, ValueKind, M>::encode,
+                                         &PBMapCodec<KeyKind, ValueKind, M>::decodeInto,
+                                         &PBMapCodec<KeyKind, ValueKind, M>::finish,
+                                         &PBMapCodec<KeyKind, ValueKind, M>::reserve };
+
+template <PBKind KeyKind, PBKind ValueKind, typename M>
+inline constexpr PBFieldOps pbViewMapOps = { &PBMapCodec<KeyKind, ValueKind, M>::decode,
+                                             nullptr,
+                                             nullptr,
+                                             &PBMapCodec<KeyKind, ValueKind, M>::decodeInto,
+                                             &PBMapCodec<KeyKind, ValueKind, M>::finish,
+                                             &PBMapCodec<KeyKind, ValueKind, M>::reserve };
+
+// One alternative of a oneof. The member is the std::variant, and each alternative has a table
+// entry of its own that only acts while alternative I is the one that is set. std::variant
+// takes no allocator, so with --pmr the alternatives allocate from the default resource.
+template <PBKind Kind, size_t I, typename M>
+struct PBOneofCodec
+{
+  using T = std::variant_alternative_t<I, M>;
+
+  // A submessage alternative that is already set is merged into, like a singular submessage.
+  static void decode(const PBField& field, void* member, PBView::iterator& entry)
+  {
+    read(field, member, entry, ((M*)member)->index() == I);
+  }
+  // Here an alternative still set from the previous message is decoded over; only one decoded
+  // from this message is merged into.
+  static void decodeInto(const PBField& field, void* member, PBView::iterator& entry, size_t& used)
+  {
+    if (entry.tag != field.tag.bytes)
+      return;
+    read(field, member, entry, used);
+    used = 1;
+  }
+  static void read(const PBField& field, void* member, PBView::iterator& entry, bool merge)
+  {
+    if (entry.tag != field.tag.bytes)
+      return;
+    T& value = pbAlternative<I>(*(M*)member);
+    if constexpr (Kind == PBKind::Message)
+    {
+      if (merge)
+        merge_from_protobuf(entry.pbview(), value);
+      else
+        decode_into(entry.pbview(), value);
+    }
+    else if constexpr (pbWireType(Kind) == Delim)
+      PBFieldCodec<Kind, false, T>::decode(field, &value, entry);
+    else
+      tableDecodeScalar(field, &value, entry);
+  }
+  // Other alternatives that were decoded are left alone; only a stale one is reset.
+  static void finish(const PBField&, void* member, size_t used)
+  {
+    M& m = *(M*)member;
+    if (!used && m.index() == I)
+      m = M();
+  }
+  // A set alternative is written even if it holds the default value.
+  static size_t size(const PBField& field, const void* member, PBSizes* sizes)
+  {
+    const T* value = std::get_if<I>((const M*)member);
+    if (!value)
+      return 0;
+    if constexpr (Kind == PBKind::Message)
+      return sizeMessage(field.tag, *value, sizes, true);
+    else if constexpr (pbWireType(Kind) == Delim)
+      return sizeLengthDelim(field.tag, *value, true);
+    else
+      return tableSizeScalar(field, value, true);
+  }
+  static void encode(const PBField& field, PBWriter& out, const void* member, PBSizes& sizes)
+  {
+    const T* value = std::get_if<I>((const M*)member);
+    if (!value)
+      return;
+    if constexpr (Kind == PBKind::Message)
+      out.addMessage(field.tag, *value, sizes, true);
+    else if constexpr (pbWireType(Kind) == Delim)
+      out.addLengthDelim(field.tag, *value, true);
+    else
+      tableEncodeScalar(field, out, value, true);
+  }
+};
+
+template <PBKind Kind, size_t I, typename M>
+inline constexpr PBFieldOps pbOneofOps = { &PBOneofCodec<Kind, I, M>::decode,
+                                           &PBOneofCodec<Kind, I, M>::size,
+                                           &PBOneofCodec<Kind, I, M>::encode,
+                                           &PBOneofCodec<Kind, I, M>::decodeInto,
+                                           &PBOneofCodec<Kind, I, M>::finish,
+                                           nullptr };
+
+template <PBKind Kind, size_t I, typename M>
+inline constexpr PBFieldOps pbViewOneofOps = { &PBOneofCodec<Kind, I, M>::decode,
+                                               nullptr,
+                                               nullptr,
+                                               &PBOneofCodec<Kind, I, M>::decodeInto,
+                                               &PBOneofCodec<Kind, I, M>::finish,
+                                               nullptr };
+
+template <typename T>
+T tableLoad(const void* p)
+{
+  T value;
+  memcpy(&value, p, sizeof(T));
+  return value;
+}
+
+template <typename T>
+void tableStore(void* p, T value)
+{
+  memcpy(p, &value, sizeof(T));
+}
+
+inline size_t tableSizeScalar(const PBField& field, const void* m, bool addEvenIfZero)
+{
+  switch (field.kind)
+  {
+    case PBKind::Int32:
+      return sizeVarint(field.tag, tableLoad<int32_t>(m), addEvenIfZero);
+    case PBKind::Enum:
+    case PBKind::UInt32:
+      return sizeVarint(field.tag, tableLoad<uint32_t>(m), addEvenIfZero);
+    case PBKind::Int64:
+      return sizeVarint(field.tag, tableLoad<int64_t>(m), addEvenIfZero);
+    case PBKind::UInt64:
+      return sizeVarint(field.tag, tableLoad<uint64_t>(m), addEvenIfZero);
+    case PBKind::SInt32:
+      return sizeVarint(field.tag, zigzag(tableLoad<int32_t>(m)), addEvenIfZero);
+    case PBKind::SInt64:
+      return sizeVarint(field.tag, zigzag(tableLoad<int64_t>(m)), addEvenIfZero);
+    case PBKind::Bool:
+      return sizeVarint(field.tag, tableLoad<bool>(m), addEvenIfZero);
+    case PBKind::Fixed32:
+    case PBKind::SFixed32:
+      return sizeInt32(field.tag, tableLoad<uint32_t>(m), addEvenIfZero);
+    case PBKind::Fixed64:
+    case PBKind::SFixed64:
+      return sizeInt64(field.tag, tableLoad<uint64_t>(m), addEvenIfZero);
+    case PBKind::Float:
+      return sizeFloat(field.tag, tableLoad<float>(m));
+    case PBKind::Double:
+      return sizeDouble(field.tag, tableLoad<double>(m));
+    default:
+      throw std::runtime_error("Invalid field table");
+  }
+}
+
+inline void tableEncodeScalar(const PBField& field,
+                              PBWriter&       out,
+                              const void*     m,
+                              bool            addEvenIfZero)
+{
+  switch (field.kind)
+  {
+    case PBKind::Int32:
+      return out.addVarint(field.tag, tableLoad<int32_t>(m), addEvenIfZero);
+    case PBKind::Enum:
+    case PBKind::UInt32:
+      return out.addVarint(field.tag, tableLoad<uint32_t>(m), addEvenIfZero);
+    case PBKind::Int64:
+      return out.addVarint(field.tag, tableLoad<int64_t>(m), addEvenIfZero);
+    case PBKind::UInt64:
+      return out.addVarint(field.tag, tableLoad<uint64_t>(m), addEvenIfZero);
+    case PBKind::SInt32:
+      return out.addVarint(field.tag, zigzag(tableLoad<int32_t>(m)), addEvenIfZero);
+    case PBKind::SInt64:
+      return out.addVarint(field.tag, zigzag(tableLoad<int64_t>(m)), addEvenIfZero);
+    case PBKind::Bool:
+      return out.addVarint(field.tag, tableLoad<bool>(m), addEvenIfZero);
+    case PBKind::Fixed32:
+    case PBKind::SFixed32:
+      return out.addInt32(field.tag, tableLoad<uint32_t>(m), addEvenIfZero);
+    case PBKind::Fixed64:
+    case PBKind::SFixed64:
+      return out.addInt64(field.tag, tableLoad<uint64_t>(m), addEvenIfZero);
+    case PBKind::Float:
+      return out.addFloat(field.tag, tableLoad<float>(m));
+    case PBKind::Double:
+      return out.addDouble(field.tag, tableLoad<double>(m));
+    default:
+      throw std::runtime_error("Invalid field table");
+  }
+}
+
+inline void tableDecodeScalar(const PBField& field, void* m, PBView::iterator& entry)
+{
+  switch (field.kind)
+  {
+    case PBKind::Int32:
+    case PBKind::Enum:
+    case PBKind::SFixed32:
+      return tableStore(m, (int32_t)entry.read());
+    case PBKind::UInt32:
+    case PBKind::Fixed32:
+      return tableStore(m, (uint32_t)entry.read());
+    case PBKind::Int64:
+    case PBKind::SFixed64:
+      return tableStore(m, (int64_t)entry.read());
+    case PBKind::UInt64:
+    case PBKind::Fixed64:
+      return tableStore(m, (uint64_t)entry.read());
+    case PBKind::SInt32:
+      return tableStore(m, (int32_t)unzigzag(entry.read()));
+    case PBKind::SInt64:
+      return tableStore(m, (int64_t)unzigzag(entry.read()));
+    case PBKind::Bool:
+      return tableStore(m, (bool)entry.read());
+    case PBKind::Float:
+      return tableStore(m, (float)entry.readDouble());
+    case PBKind::Double:
+      return tableStore(m, entry.readDouble());
+    default:
+      throw std::runtime_error("Invalid field table");
+  }
+}
+
+inline void tableClearScalar(const PBField& field, void* m)
+{
+  switch (field.kind)
+  {
+    case PBKind::Bool:
+      return tableStore(m, false);
+    case PBKind::Int64:
+    case PBKind::UInt64:
+    case PBKind::SInt64:
+    case PBKind::Fixed64:
+    case PBKind::SFixed64:
+    case PBKind::Double:
+      return tableStore(m, uint64_t(0));
+    default:
+      return tableStore(m, uint32_t(0));
+  }
+}
+
+// As in tableDecode(), fields within the first 64 whose bit is clear in `fields` are left out.
+inline size_t tableByteSize(const PBMessageTable& table,
+                            const void*           in,
+                            PBSizes*              sizes,
+                            uint64_t              fields)
+{
+  size_t size = 0;
+  for (size_t n = 0; n < table.count; n++)
+  {
+    if (n < 64 && !(fields >> n & 1))
+      continue;
+    const PBField& field = table.fields[n];
+    const void*    m     = (const char*)in + field.offset;
+    if (field.ops)
+    {
+      size += field.ops->size(field, m, sizes);
+    }
+    else if (field.nested)
+    {
+      size_t nested;
+      if (sizes)
+      {
+        size_t slot = sizes->open();
+        nested      = tableByteSize(*field.nested, m, sizes);
+        sizes->close(slot, nested);
+      }
+      else
+      {
+        nested = tableByteSize(*field.nested, m, nullptr);
+      }
+      size += nested ? field.tag.size + varintSize(nested) + nested : 0;
+    }
+    else
+    {
+      size += tableSizeScalar(field, m);
+    }
+  }
+  return size;
+}
+
+inline void tableEncode(const PBMessageTable& table,
+                        PBWriter&             out,
+                        const void*           in,
+                        PBSizes&              sizes,
+                        uint64_t              fields)
+{
+  for (size_t n = 0; n < table.count; n++)
+  {
+    if (n < 64 && !(fields >> n & 1))
+      continue;
+    const PBField& field = table.fields[n];
+    const void*    m     = (const char*)in + field.offset;
+    if (field.ops)
+    {
+      field.ops->encode(field, out, m, sizes);
+    }
+    else if (field.nested)
+    {
+      size_t size = sizes.pop();
+      if (size == 0)
+        continue;
+      out.writeTag(field.tag);
+      out.writeVarint(size);
+      tableEncode(*field.nested, out, m, sizes);
+    }
+    else
+    {
+      tableEncodeScalar(field, out, m);
+    }
+  }
+}
+
+// Fields usually arrive in table order, so the field after the last match is tried first, then
+// the last match again for repeated fields, before searching the whole table.
+inline const PBField* tableMatch(const PBMessageTable& table, const PBField*& next, size_t number)
+{
+  const PBField* begin = table.fields;
+  const PBField* end   = begin + table.count;
+  const PBField* field;
+  if (next != end && next->number == number)
+    field = next;
+  else if (next != begin && next[-1].number == number)
+    field = next - 1;
+  else
+    field = std::find_if(begin, end, [&](const PBField& f) { return f.number == number; });
+  if (field != end)
+    next = field + 1;
+  return field;
+}
+
+// Fields within the first 64 whose bit is clear in `fields` are skipped. Submessages are
+// decoded in place, so one that occurs twice is merged.
+inline void tableDecode(const PBMessageTable& table, void* out, PBView data, uint64_t fields)
+{
+  const PBField* begin = table.fields;
+  const PBField* end   = begin + table.count;
+  const PBField* next  = begin;
+  for (auto& entry : data)
+  {
+    const PBField* field = tableMatch(table, next, entry.number);
+    if (field == end)
+      continue;
+    if (field - begin < 64 && !(fields >> (field - begin) & 1))
+      continue;
+    void* m = (char*)out + field->offset;
+    if (field->ops)
+      field->ops->decode(*field, m, entry);
+    else if (entry.tag != field->tag.bytes)
+      continue;
+    else if (field->nested)
+      tableDecode(*field->nested, m, entry.pbview());
+    else
+      tableDecodeScalar(*field, m, entry);
+  }
+}
+
+// Decodes over what `out` already holds, counting the occurrences of each field; afterwards
+// every field that did not occur is cleared and repeated fields are cut back to what was decoded.
+inline void tableDecodeInto(const PBMessageTable& table, void* out, PBView data)
+{
+  size_t                    stack[32];
+  std::unique_ptr<size_t[]> heap;
+  size_t*                   used = stack;
+  if (table.count > 32)
+    used = (heap = std::make_unique<size_t[]>(table.count)).get();
+  std::fill(used, used + table.count, 0);
+  const PBField* begin = table.fields;
+  const PBField* end   = begin + table.count;
+  const PBField* next  = begin;
+  for (auto& entry : data)
+  {
+    const PBField* field = tableMatch(table, next, entry.number);
+    if (field == end)
+      continue;
+    size_t n = field - begin;
+    void*  m = (char*)out + field->offset;
+    if (field->ops)
+    {
+      field->ops->decodeInto(*field, m, entry, used[n]);
+      continue;
+    }
+    if (entry.tag != field->tag.bytes)
+      continue;
+    // A submessage that occurs again is merged into, as protobuf requires.
+    if (field->nested && used[n])
+      tableDecode(*field->nested, m, entry.pbview());
+    else if (field->nested)
+      tableDecodeInto(*field->nested, m, entry.pbview());
+    else
+      tableDecodeScalar(*field, m, entry);
+    used[n] = 1;
+  }
+  for (size_t n = 0; n < table.count; n++)
+  {
+    const PBField& field = table.fields[n];
+    void*          m     = (char*)out + field.offset;
+    if (field.ops)
+      field.ops->finish(field, m, used[n]);
+    else if (used[n])
+      continue;
+    else if (field.nested)
+      tableDecodeInto(*field.nested, m, PBView(nullptr, 0));
+    else
+      tableClearScalar(field, m);
+  }
+}
+
+// Counts the entries of maps and the elements of repeated fields that are not packed in a pass
+// that only matches tags, then reserves each to exactly that size. Generated code calls it for
+// messages with maps, and with --reserve for every message with such repeated fields.
+inline void tableReserve(const PBMessageTable& table, void* out, PBView data)
+{
+  const PBField* begin = table.fields;
+  const PBField* end   = begin + table.count;
+  if (std::none_of(begin, end, [](const PBField& f) { return f.ops && f.ops->reserve; }))
+    return;
+  size_t                    stack[32];
+  std::unique_ptr<size_t[]> heap;
+  size_t*                   counts = stack;
+  if (table.count > 32)
+    counts = (heap = std::make_unique<size_t[]>(table.count)).get();
+  std::fill(counts, counts + table.count, 0);
+  const PBField* next = begin;
+  for (auto& entry : data)
+  {
+    const PBField* field = tableMatch(table, next, entry.number);
+    if (field != end && entry.tag == field->tag.bytes)
+      counts[field - begin]++;
+  }
+  for (size_t n = 0; n < table.count; n++)
+  {
+    const PBField& field = table.fields[n];
+    if (counts[n] && field.ops && field.ops->reserve)
+      field.ops->reserve((char*)out + field.offset, counts[n]);
+  }
+}
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <memory_resource>
+#include <stdexcept>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Hash used by PBFlatMap. The result is multiplied by a large odd constant and the table takes
+// its buckets from the top bits, since std::hash of an integer is often the integer itself.
+// Anything that converts to a std::string_view hashes as one, so std::string keys can be looked
+// up with a std::string_view or a string literal without allocating.
+struct PBMapHash
+{
+  template <typename Q>
+  uint64_t operator()(const Q& key) const
+  {
+    uint64_t h;
+    if constexpr (std::is_convertible_v<const Q&, std::string_view>)
+      h = std::hash<std::string_view>()(std::string_view(key));
+    else if constexpr (std::is_integral_v<Q> || std::is_enum_v<Q>)
+      h = uint64_t(key);
+    else
+      h = std::hash<Q>()(key);
+    return h * 0x9E3779B97F4A7C15ULL;
+  }
+};
+
+// Open-addressing hash map for protobuf map fields. The entries live in one vector in insertion
+// order, so iterating is a linear scan and decoding then re-encoding keeps the wire order. The
+// index is a power-of-two array of 8-byte slots, each holding an entry number and the top 32
+// bits of its key's hash, probed linearly; most misses are told apart without touching the key.
+// Keys must not be changed through an iterator. Erasing moves the last entry into the gap.
+template <typename K, typename V, typename Alloc = std::allocator<std::pair<K, V>>>
+class PBFlatMap
+{
+  struct Slot
+  {
+    uint32_t entry = 0; // entry number + 1; 0 is empty
+    uint32_t hash  = 0;
+  };
+  using Entries = std::vector<std::pair<K, V>, Alloc>;
+  using Slots =
+    std::vector<Slot, typename std::allocator_traits<Alloc>::template rebind_alloc<Slot>>;
+
+public:
+  using key_type       = K;
+  using mapped_type    = V;
+  using value_type     = std::pair<K, V>;
+  using size_type      = size_t;
+  using allocator_type = Alloc;
+  using iterator       = typename Entries::iterator;
+  using const_iterator = typename Entries::const_iterator;
+
+  PBFlatMap() = default;
+  explicit PBFlatMap(const Alloc& alloc)
+    : entries_(alloc)
+    , slots_(alloc)
+  {
+  }
+  PBFlatMap(std::initializer_list<value_type> init, const Alloc& alloc = Alloc())
+    : PBFlatMap(alloc)
+  {
+    reserve(init.size());
+    for (auto& value : init)
+      insert_or_assign(value.first, value.second);
+  }
+  PBFlatMap(const PBFlatMap&)            = default;
+  PBFlatMap(PBFlatMap&&)                 = default;
+  PBFlatMap& operator=(const PBFlatMap&) = default;
+  PBFlatMap& operator=(PBFlatMap&&)      = default;
+  // Allocator-extended copy and move, for --pmr structs.
+  PBFlatMap(const PBFlatMap& other, const Alloc& alloc)
+    : entries_(other.entries_, alloc)
+    , slots_(other.slots_, alloc)
+    , shift_(other.shift_)
+  {
+  }
+  PBFlatMap(PBFlatMap&& other, const Alloc& alloc)
+    : entries_(std::move(other.entries_), alloc)
+    , slots_(std::move(other.slots_), alloc)
+    , shift_(other.shift_)
+  {
+    other.clear();
+  }
+
+  allocator_type get_allocator() const
+  {
+    return entries_.get_allocator();
+  }
+  size_t size() const
+  {
+    return entries_.size();
+  }
+  bool empty() const
+  {
+    return entries_.empty();
+  }
+  iterator begin()
+  {
+    return entries_.begin();
+  }
+  iterator end()
+  {
+    return entries_.end();
+  }
+  const_iterator begin() const
+  {
+    return entries_.begin();
+  }
+  const_iterator end() const
+  {
+    return entries_.end();
+  }
+
+  // Makes room for `count` entries, so that inserting them neither reallocates nor rehashes.
+  void reserve(size_t count)
+  {
+    entries_.reserve(count);
+    if (count * 4 > slots_.size() * 3)
+      rehash(slotsFor(count));
+  }
+  // Empties the map but keeps both allocations.
+  void clear()
+  {
+    entries_.clear();
+    std::fill(slots_.begin(), slots_.end(), Slot{});
+  }
+
+  template <typename Q>
+  iterator find(const Q& key)
+  {
+    size_t slot = lookup(asKey(key));
+    return slot == npos ? end() : begin() + (slots_[slot].entry - 1);
+  }
+  template <typename Q>
+  const_iterator find(const Q& key) const
+  {
+    size_t slot = lookup(asKey(key));
+    return slot == npos ? end() : begin() + (slots_[slot].entry - 1);
+  }
+  template <typename Q>
+  bool contains(const Q& key) const
+  {
+    return lookup(asKey(key)) != npos;
+  }
+  template <typename Q>
+  size_t count(const Q& key) const
+  {
+    return contains(key);
+  }
+  template <typename Q>
+  V& at(const Q& key)
+  {
+    auto it = find(key);
+    if (it == end())
+      throw std::out_of_range("PBFlatMap::at");
+    return it->second;
+  }
+  template <typename Q>
+  const V& at(const Q& key) const
+  {
+    auto it = find(key);
+    if (it == end())
+      throw std::out_of_range("PBFlatMap::at");
+    return it->second;
+  }
+  V& operator[](const K& key)
+  {
+    return try_emplace(key).first->second;
+  }
+  V& operator[](K&& key)
+  {
+    return try_emplace(std::move(key)).first->second;
+  }
+
+  template <typename Key, typename... Args>
+  std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args)
+  {
+    uint64_t h    = PBMapHash()(asKey(key));
+    size_t   slot = lookup(asKey(key), h);
+    if (slot != npos)
+      return { begin() + (slots_[slot].entry - 1), false };
+    if ((entries_.size() + 1) * 4 > slots_.size() * 3)
+      rehash(std::max<size_t>(slots_.size() * 2, 8));
+    entries_.emplace_back(std::piecewise_construct,
+                          std::forward_as_tuple(std::forward<Key>(key)),
+                          std::forward_as_tuple(std::forward<Args>(args)...));
+    place(uint32_t(entries_.size()), uint32_t(h >> 32));
+    return { end() - 1, true };
+  }
+  template <typename Key, typename M>
+  std::pair<iterator, bool> insert_or_assign(Key&& key, M&& value)
+  {
+    auto rv = try_emplace(std::forward<Key>(key), std::forward<M>(value));
+    if (!rv.second)
+      rv.first->second = std::forward<M>(value);
+    return rv;
+  }
+  std::pair<iterator, bool> insert(const value_type& value)
+  {
+    return try_emplace(value.first, value.second);
+  }
+  std::pair<iterator, bool> insert(value_type&& value)
+  {
+    return try_emplace(std::move(value.first), std::move(value.second));
+  }
+  template <typename Key, typename M>
+  std::pair<iterator, bool> emplace(Key&& key, M&& value)
+  {
+    return try_emplace(std::forward<Key>(key), std::forward<M>(value));
+  }
+
+  template <typename Q>
+  size_t erase(const Q& key)
+  {
+    size_t slot = lookup(asKey(key));
+    if (slot == npos)
+      return 0;
+    size_t entry = slots_[slot].entry - 1;
+    unplace(slot);
+    size_t last = entries_.size() - 1;
+    if (entry != last)
+    {
+      // The last entry moves into the gap; repoint the slot that refers to it.
+      size_t moved = lookupEntry(last);
+      entries_[entry] = std::move(entries_[last]);
+      slots_[moved].entry = uint32_t(entry + 1);
+    }
+    entries_.pop_back();
+    return 1;
+  }
+
+  // Equal if both hold the same keys with equal values, in whatever order.
+  friend bool operator==(const PBFlatMap& a, const PBFlatMap& b)
+  {
+    if (a.size() != b.size())
+      return false;
+    for (auto& [key, value] : a)
+    {
+      auto it = b.find(key);
+      if (it == b.end() || !(it->second == value))
+        return false;
+    }
+    return true;
+  }
+
+private:
+  static constexpr size_t npos = SIZE_MAX;
+
+  // The index is kept at most 3/4 full.
+  static size_t slotsFor(size_t count)
+  {
+    return std::max<size_t>(std::bit_ceil((count * 4 + 2) / 3), 8);
+  }
+  size_t bucket(uint32_t hash) const
+  {
+    return hash >> shift_;
+  }
+  size_t mask() const
+  {
+    return slots_.size() - 1;
+  }
+  // Arithmetic keys are looked up as K, so that a literal of another type hashes the same.
+  template <typename Q>
+  static decltype(auto) asKey(const Q& key)
+  {
+    if constexpr (std::is_arithmetic_v<K>)
+      return K(key);
+    else
+      return (key);
+  }
+  template <typename Q>
+  size_t lookup(const Q& key) const
+  {
+    return lookup(key, PBMapHash()(key));
+  }
+  template <typename Q>
+  size_t lookup(const Q& key, uint64_t h) const
+  {
+    if (slots_.empty())
+      return npos;
+    uint32_t hash = uint32_t(h >> 32);
+    for (size_t n = bucket(hash);; n = (n + 1) & mask())
+    {
+      const Slot& s = slots_[n];
+      if (s.entry == 0)
+        return npos;
+      if (s.hash == hash && entries_[s.entry - 1].first == key)
+        return n;
+    }
+  }
+  size_t lookupEntry(size_t entry) const
+  {
+    uint32_t hash = uint32_t(PBMapHash()(entries_[entry].first) >> 32);
+    size_t   n    = bucket(hash);
+    while (slots_[n].entry != entry + 1)
+      n = (n + 1) & mask();
+    return n;
+  }
+  void place(uint32_t entry, uint32_t hash)
+  {
+    size_t n = bucket(hash);
+    while (slots_[n].entry)
+      n = (n + 1) & mask();
+    slots_[n] = { entry, hash };
+  }
+  // Backward-shift deletion: later slots of the same run move up, so no tombstones are needed.
+  void unplace(size_t hole)
+  {
+    for (size_t n = (hole + 1) & mask(); slots_[n].entry; n = (n + 1) & mask())
+    {
+      size_t home = bucket(slots_[n].hash);
+      // Move the slot up unless its home lies cyclically in (hole, n].
+      if (((n - home) & mask()) >= ((n - hole) & mask()))
+      {
+        slots_[hole] = slots_[n];
+        hole         = n;
+      }
+    }
+    slots_[hole] = {};
+  }
+  void rehash(size_t count)
+  {
+    Slots old(count, Slot{}, slots_.get_allocator());
+    old.swap(slots_);
+    shift_ = 32 - std::countr_zero(count);
+    for (auto& s : old)
+    {
+      if (s.entry)
+        place(s.entry, s.hash);
+    }
+  }
+
+  Entries entries_;
+  Slots   slots_;
+  int     shift_ = 32;
+};
+
+// PBFlatMap that allocates from a memory resource, for --pmr structs.
+template <typename K, typename V>
+using PBPmrFlatMap = PBFlatMap<K, V, std::pmr::polymorphic_allocator<std::pair<K, V>>>;
@@ -0,0 +1,488 @@
+#pragma once
+
+#include "Protobuf.h"
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+// Multi-threaded encoding and decoding, for messages too large for one core and for batches of
+// many small ones. Everything here is built on the generated byte_size, encode and
+// from_protobuf specializations and on the pbMember/pbRepeatedMessages tables in the header.
+
+// Fixed set of worker threads that run one loop at a time together with the calling thread.
+// Every thread starts on an equal share of the loop's chunks and, once that runs out, steals
+// the back half of what another thread has left, so uneven chunks still keep everyone busy.
+class PBThreadPool
+{
+public:
+  explicit PBThreadPool(size_t threads = std::max(1u, std::thread::hardware_concurrency()))
+    : shares_(std::max<size_t>(threads, 1))
+  {
+    for (size_t n = 1; n < shares_.size(); n++)
+      workers_.emplace_back([this, n] { run(n); });
+  }
+  ~PBThreadPool()
+  {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_)
+      worker.join();
+  }
+  PBThreadPool(const PBThreadPool&)            = delete;
+  PBThreadPool& operator=(const PBThreadPool&) = delete;
+
+  // Number of threads a loop runs on, the caller included.
+  size_t size() const
+  {
+    return shares_.size();
+  }
+  static PBThreadPool& shared()
+  {
+    static PBThreadPool pool;
+    return pool;
+  }
+
+  // Calls f(begin, end) for consecutive ranges of at most `grain` indexes covering [0, count)
+  // and returns once all of them are done. The first exception thrown by f is rethrown here.
+  // Loops started from inside a loop run on the calling thread.
+  template <typename F>
+  void parallelFor(size_t count, size_t grain, F&& f)
+  {
+    grain = std::max<size_t>(grain, 1);
+    if (count <= grain || workers_.empty() || inLoop())
+    {
+      if (count)
+        f(size_t(0), count);
+      return;
+    }
+    std::lock_guard one(loopMutex_);
+    Job             job{ count, grain, (void*)&f, [](void* ctx, size_t begin, size_t end)
+             { (*(std::remove_reference_t<F>*)ctx)(begin, end); } };
+    size_t chunks = (count + grain - 1) / grain;
+    if (chunks > UINT32_MAX)
+    {
+      job.grain = (count + UINT32_MAX - 1) / UINT32_MAX;
+      chunks    = (count + job.grain - 1) / job.grain;
+    }
+    for (size_t n = 0; n < shares_.size(); n++)
+      shares_[n].range = pack(chunks * n / shares_.size(), chunks * (n + 1) / shares_.size());
+    {
+      std::lock_guard lock(mutex_);
+      job_ = &job;
+      generation_++;
+      active_ = workers_.size();
+    }
+    wake_.notify_all();
+    inLoop() = true;
+    work(job, 0);
+    inLoop() = false;
+    {
+      std::unique_lock lock(mutex_);
+      done_.wait(lock, [&] { return active_ == 0; });
+      job_ = nullptr;
+    }
+    if (job.error)
+      std::rethrow_exception(job.error);
+  }
+
+private:
+  struct Job
+  {
+    size_t count;
+    size_t grain;
+    void*  ctx;
+    void (*call)(void* ctx, size_t begin, size_t end);
+    std::mutex         errorMutex{};
+    std::exception_ptr error{};
+    std::atomic<bool>  failed{ false };
+  };
+  // The chunks [begin, end) a thread has yet to run, packed into one word so that the owner
+  // taking from the front and thieves taking from the back agree through a single CAS.
+  struct alignas(64) Share
+  {
+    std::atomic<uint64_t> range{ 0 };
+  };
+  static uint64_t pack(uint64_t begin, uint64_t end)
+  {
+    return begin | end << 32;
+  }
+  static bool& inLoop()
+  {
+    thread_local bool flag = false;
+    return flag;
+  }
+  void work(Job& job, size_t self)
+  {
+    std::atomic<uint64_t>& mine = shares_[self].range;
+    for (;;)
+    {
+      uint64_t range = mine.load(std::memory_order_relaxed);
+      uint64_t begin = uint32_t(range);
+      uint64_t end   = range >> 32;
+      if (begin < end)
+      {
+        if (!mine.compare_exchange_weak(range, pack(begin + 1, end), std::memory_order_relaxed))
+          continue;
+        if (job.failed.load(std::memory_order_relaxed))
+          continue;
+        try
+        {
+          job.call(job.ctx, begin * job.grain, std::min((begin + 1) * job.grain, job.count));
+        }
+        catch (...)
+        {
+          std::lock_guard lock(job.errorMutex);
+          if (!job.error)
+            job.error = std::current_exception();
+          job.failed = true;
+        }
+      }
+      else if (!steal(self))
+      {
+        return;
+      }
+    }
+  }
+  // Moves the back half of another thread's remaining chunks to this thread's empty share.
+  bool steal(size_t self)
+  {
+    for (size_t n = 1; n < shares_.size(); n++)
+    {
+      std::atomic<uint64_t>& victim = shares_[(self + n) % shares_.size()].range;
+      uint64_t               range  = victim.load(std::memory_order_relaxed);
+      for (;;)
+      {
+        uint64_t begin = uint32_t(range);
+        uint64_t end   = range >> 32;
+        if (begin >= end)
+          break;
+        uint64_t middle = end - (end - begin + 1) / 2;
+        if (victim.compare_exchange_weak(range, pack(begin, middle), std::memory_order_relaxed))
+        {
+          shares_[self].range.store(pack(middle, end), std::memory_order_relaxed);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+  void run(size_t self)
+  {
+    inLoop()    = true;
+    size_t seen = 0;
+    std::unique_lock lock(mutex_);
+    for (;;)
+    {
+      wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+      if (stop_)
+        return;
+      seen     = generation_;
+      Job* job = job_;
+      lock.unlock();
+      work(*job, self);
+      lock.lock();
+      if (--active_ == 0)
+        done_.notify_one();
+    }
+  }
+
+  std::vector<Share>       shares_;
+  std::vector<std::thread> workers_;
+  std::mutex               loopMutex_;
+  std::mutex               mutex_;
+  std::condition_variable  wake_;
+  std::condition_variable  done_;
+  Job*                     job_        = nullptr;
+  size_t                   generation_ = 0;
+  size_t                   active_     = 0;
+  bool                     stop_       = false;
+};
+
+// Items per task: one task below `minItems`, otherwise about eight tasks per thread.
+inline size_t pbGrain(size_t count, PBThreadPool& pool, size_t minItems)
+{
+  return count < minItems ? count : std::max<size_t>(64, count / (8 * pool.size()));
+}
+
+// Decodes the submessages in `elements` into `out`, which is resized to hold exactly them.
+template <typename V>
+void pbDecodeElements(V&                         out,
+                      const std::vector<PBView>& elements,
+                      PBThreadPool&              pool,
+                      size_t                     minElements)
+{
+  using E = typename V::value_type;
+  out.resize(elements.size());
+  pool.parallelFor(elements.size(), pbGrain(elements.size(), pool, minElements),
+                   [&](size_t begin, size_t end)
+                   {
+                     for (size_t n = begin; n < end; n++)
+                       out[n] = from_protobuf<E>(elements[n]);
+                   });
+}
+
+template <typename T, size_t... I>
+T pbDecodeParallel(PBView data, PBThreadPool& pool, size_t minElements, std::index_sequence<I...>)
+{
+  constexpr auto&  members = pbRepeatedMessages<T>;
+  constexpr size_t count   = sizeof...(I);
+  constexpr std::array<uint64_t, count> tags = {
+    PBTag(pbMember<std::get<I>(members)>.number, Delim).bytes...
+  };
+  constexpr uint64_t skip = (pbMember<std::get<I>(members)>.bit | ...);
+
+  // Structural pass: only tags and lengths are read, to find where every element lies.
+  std::array<std::vector<PBView>, count> elements;
+  for (auto& entry : data)
+  {
+    for (size_t n = 0; n < count; n++)
+    {
+      if (entry.tag == tags[n])
+      {
+        elements[n].push_back(entry.pbview());
+        break;
+      }
+    }
+  }
+  T rv = from_protobuf<T>(data, ~skip);
+  (pbDecodeElements(rv.*std::get<I>(members), elements[I], pool, minElements), ...);
+  return rv;
+}
+
+// Decodes like from_protobuf<T>(data), but spreads the elements of T's repeated submessage
+// fields over the pool. A first pass over the top level of the message finds each element by
+// its tag and length; the vectors are then sized once and the elements decoded into place in
+// parallel, while the other fields go through a projected decode on the calling thread. Fields
+// with fewer than `minElements` elements are decoded on the calling thread as well. The result
+// is the same as that of from_protobuf<T>(data).
+template <typename T>
+T from_protobuf_parallel(PBView        data,
+                         PBThreadPool& pool        = PBThreadPool::shared(),
+                         size_t        minElements = 1024)
+{
+  constexpr size_t count = std::tuple_size_v<std::remove_cvref_t<decltype(pbRepeatedMessages<T>)>>;
+  if constexpr (count == 0)
+    return from_protobuf<T>(data);
+  else
+    return pbDecodeParallel<T>(data, pool, minElements, std::make_index_sequence<count>());
+}
+
+// A run of consecutive items encoded by one task. Their sizes are computed into the task's own
+// PBSizes first; once all tasks are sized, each one is encoded into the output at `offset`.
+struct PBEncodeChunk
+{
+  size_t  begin;
+  size_t  end;
+  size_t  bytes  = 0;
+  size_t  offset = 0;
+  PBSizes sizes{};
+};
+
+// Splits [0, count) into chunks of `grain` items and sizes them in parallel; size(n, sizes)
+// returns the encoded size of item n.
+template <typename F>
+std::vector<PBEncodeChunk> pbSizeChunks(size_t count, size_t grain, PBThreadPool& pool, F&& size)
+{
+  std::vector<PBEncodeChunk> chunks;
+  for (size_t begin = 0; begin < count; begin += grain)
+    chunks.push_back({ begin, std::min(begin + grain, count) });
+  pool.parallelFor(chunks.size(), 1,
+                   [&](size_t begin, size_t end)
+                   {
+                     for (auto c = chunks.begin() + begin; c != chunks.begin() + end; ++c)
+                     {
+                       for (size_t n = c->begin; n < c->end; n++)
+                         c->bytes += size(n, c->sizes);
+                     }
+                   });
+  return chunks;
+}
+
+// Encodes every chunk into its own region of `out` in parallel; encode(writer, n, sizes)
+// writes item n.
+template <typename F>
+void pbEncodeChunks(std::vector<PBEncodeChunk>& chunks,
+                    uint8_t*                    out,
+                    PBThreadPool&               pool,
+                    F&&                         encode)
+{
+  pool.parallelFor(chunks.size(), 1,
+                   [&](size_t begin, size_t end)
+                   {
+                     for (auto c = chunks.begin() + begin; c != chunks.begin() + end; ++c)
+                     {
+                       PBSpanWriter writer({ out + c->offset, c->bytes });
+                       for (size_t n = c->begin; n < c->end; n++)
+                         encode(writer, n, c->sizes);
+                     }
+                   });
+}
+
+template <typename V>
+std::vector<PBEncodeChunk> pbSizeElements(const V&      values,
+                                          PBTag         tag,
+                                          PBThreadPool& pool,
+                                          size_t        minElements)
+{
+  return pbSizeChunks(values.size(), pbGrain(values.size(), pool, minElements), pool,
+                      [&](size_t n, PBSizes& sizes)
+                      { return sizeMessage(tag, values[n], &sizes); });
+}
+
+template <typename V>
+void pbEncodeElements(const V&                    values,
+                      PBTag                       tag,
+                      std::vector<PBEncodeChunk>& chunks,
+                      uint8_t*                    out,
+                      PBThreadPool&               pool)
+{
+  pbEncodeChunks(chunks, out, pool,
+                 [&](PBWriter& writer, size_t n, PBSizes& sizes)
+                 { writer.addMessage(tag, values[n], sizes); });
+}
+
+template <typename T, size_t... I>
+PBVector pbEncodeParallel(const T&      in,
+                          PBThreadPool& pool,
+                          size_t        minElements,
+                          std::index_sequence<I...>)
+{
+  constexpr auto&  members = pbRepeatedMessages<T>;
+  constexpr size_t count   = sizeof...(I);
+  constexpr std::array<PBTag, count> tags = {
+    PBTag(pbMember<std::get<I>(members)>.number, Delim)...
+  };
+  constexpr std::array<uint64_t, count> bits = { pbMember<std::get<I>(members)>.bit... };
+  constexpr uint64_t skip = (bits[I] | ...);
+
+  // Everything but the repeated submessages is encoded on the calling thread. Fields are written
+  // in declaration order, so each repeated field goes in after the fields declared before it.
+  // Fields past the 64th have no bit and are always sized, but they are written after all of
+  // these, so their size is taken off each split.
+  PBSizes  sizes;
+  PBVector rest;
+  rest.resize(byte_size(in, &sizes, ~skip));
+  PBSpanWriter restWriter(rest);
+  encode(restWriter, in, sizes, ~skip);
+  size_t                    tail   = byte_size(in, nullptr, 0);
+  std::array<size_t, count> splits = { byte_size(in, nullptr, (bits[I] - 1) & ~skip) - tail... };
+
+  std::array<std::vector<PBEncodeChunk>, count> chunks = {
+    pbSizeElements(in.*std::get<I>(members), tags[I], pool, minElements)...
+  };
+  size_t total = rest.size();
+  for (auto& field : chunks)
+  {
+    for (auto& c : field)
+      total += c.bytes;
+  }
+  PBVector vec;
+  vec.resize(total);
+  size_t at   = 0;
+  size_t from = 0;
+  for (size_t n = 0; n < count; n++)
+  {
+    memcpy(vec.data() + at, rest.data() + from, splits[n] - from);
+    at += splits[n] - from;
+    from = splits[n];
+    for (auto& c : chunks[n])
+    {
+      c.offset = at;
+      at += c.bytes;
+    }
+  }
+  memcpy(vec.data() + at, rest.data() + from, rest.size() - from);
+  (pbEncodeElements(in.*std::get<I>(members), tags[I], chunks[I], vec.data(), pool), ...);
+  return vec;
+}
+
+// Encodes like to_protobuf(in), but sizes and encodes the elements of T's repeated submessage
+// fields on the pool. Once every element's size is known, so is the offset at which it goes,
+// and workers write disjoint ranges of the output directly. Fields with fewer than
+// `minElements` elements take one chunk each. The bytes are the same as those of to_protobuf().
+template <typename T>
+PBVector to_protobuf_parallel(const T&      in,
+                              PBThreadPool& pool        = PBThreadPool::shared(),
+                              size_t        minElements = 1024)
+{
+  constexpr size_t count = std::tuple_size_v<std::remove_cvref_t<decltype(pbRepeatedMessages<T>)>>;
+  if constexpr (count == 0)
+    return to_protobuf(in);
+  else
+    return pbEncodeParallel(in, pool, minElements, std::make_index_sequence<count>());
+}
+
+// Batch API for many small messages: each call spreads one batch over the pool and returns the
+// results in input order, whatever thread handled each message.
+
+// Decodes each message into the element of the result at the same index.
+template <typename T>
+std::vector<T> from_protobuf_batch(std::span<const PBView> messages,
+                                   PBThreadPool&           pool = PBThreadPool::shared())
+{
+  std::vector<T> out(messages.size());
+  pool.parallelFor(messages.size(), pbGrain(messages.size(), pool, 64),
+                   [&](size_t begin, size_t end)
+                   {
+                     for (size_t n = begin; n < end; n++)
+                       out[n] = from_protobuf<T>(messages[n]);
+                   });
+  return out;
+}
+
+// Decodes length-prefixed records, as written by PBRecordWriter or to_protobuf_batch(). The
+// record boundaries are found on the calling thread; only the decoding is spread out.
+template <typename T>
+std::vector<T> from_protobuf_records(PBRecords     records,
+                                     PBThreadPool& pool = PBThreadPool::shared())
+{
+  std::vector<PBView> messages;
+  for (PBView record : records)
+    messages.push_back(record);
+  return from_protobuf_batch<T>(messages, pool);
+}
+
+// Encodes each message as a length-prefixed record, in input order, into one buffer: the same
+// bytes as appending them one by one with PBRecordWriter. All messages are sized first, so that
+// each task knows where its records go and writes them there directly.
+template <typename T>
+PBVector to_protobuf_batch(std::span<const T> in, PBThreadPool& pool = PBThreadPool::shared())
+{
+  auto chunks = pbSizeChunks(in.size(), pbGrain(in.size(), pool, 64), pool,
+                             [&](size_t n, PBSizes& sizes)
+                             {
+                               size_t slot = sizes.open();
+                               size_t size = byte_size(in[n], &sizes);
+                               sizes.close(slot, size);
+                               return varintSize(size) + size;
+                             });
+  size_t total = 0;
+  for (auto& c : chunks)
+  {
+    c.offset = total;
+    total += c.bytes;
+  }
+  PBVector vec;
+  vec.resize(total);
+  pbEncodeChunks(chunks, vec.data(), pool,
+                 [&](PBWriter& writer, size_t n, PBSizes& sizes)
+                 {
+                   size_t size = sizes.pop();
+                   writer.writeVarint(size);
+                   if (size)
+                     encode(writer, in[n], sizes);
+                 });
+  return vec;
+}
+
+template <typename T, typename A>
+PBVector to_protobuf_batch(const std::vector<T, A>& in, PBThreadPool& pool = PBThreadPool::shared())
+{
+  return to_protobuf_batch(std::span<const T>(in), pool);
+}
@@ -1,12 +1,42 @@
 #pragma once
 
+#include "Varint.h"
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <span>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
 #include <vector>
+#if __has_include(<unistd.h>)
+#include <cerrno>
+#include <unistd.h>
+#endif
+#if __has_include(<sys/uio.h>)
+#include <climits>
+#include <sys/uio.h>
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#endif
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 enum wiretype
 {
@@ -16,6 +46,33 @@ enum wiretype
   U32    = 5
 };
 
+// A field tag encoded ahead of time. Encoders write it with a single store and decoders match it
+// against the raw tag bytes instead of decoding them.
+struct PBTag
+{
+  constexpr PBTag(uint32_t number, wiretype wt)
+  {
+    uint64_t v = (uint64_t(number) << 3) | wt;
+    while (v > 0x7F)
+    {
+      bytes |= ((v & 0x7F) | 0x80) << (8 * size);
+      v >>= 7;
+      size++;
+    }
+    bytes |= v << (8 * size);
+    size++;
+  }
+  constexpr wiretype type() const
+  {
+    return wiretype(bytes & 7);
+  }
+  uint64_t bytes = 0;
+  size_t   size  = 0;
+};
+
+template <uint32_t Number, wiretype Type>
+inline constexpr PBTag pbtag = PBTag(Number, Type);
+
 struct PBView
 {
   PBView(const unsigned char* dat, size_t siz)
@@ -24,6 +81,7 @@ struct PBView
   {
   }
   template <typename T>
+    requires(!std::is_same_v<std::remove_cvref_t<T>, PBView>)
   PBView(T&& container)
     : data((const unsigned char*)container.data())
     , size(container.size())
@@ -38,26 +96,39 @@ struct PBView
   {
     const unsigned char* data_;
     size_t               size_;
-    wiretype             type;
-    size_t               number;
-    size_t               length;
+    wiretype             type   = Varint;
+    size_t               number = 0;
+    uint64_t             tag    = 0;
+    size_t               length = 0;
+    uint64_t             value  = 0;
+    // Set once the last field is stepped past; a trailing empty field leaves size_ at 0 too.
+    bool                 done   = false;
     size_t               readVarint()
     {
-      size_t   offset = 7;
-      uint64_t val    = 0;
-      val |= (*data_) & 0x7f;
-      while (*data_ & 0x80)
+      const unsigned char* p   = data_;
+      uint64_t             val = decodeVarint(p, data_ + size_);
+      size_ -= p - data_;
+      data_ = p;
+      return val;
+    }
+
+    // Keeps the raw tag bytes in `tag`, so decoders can compare them against a PBTag directly.
+    void readTag()
+    {
+      uint64_t raw = 0;
+      size_t   n   = 0;
+      do
       {
-        ++data_;
-        val |= ((*data_) & 0x7F) << offset;
-        offset += 7;
-        size_--;
-        if (size_ == 0)
+        if (n == size_)
           throw std::runtime_error("Short packet");
-      }
-      ++data_;
-      --size_;
-      return val;
+        if (n == 5)
+          throw std::runtime_error("Invalid tag");
+        raw |= uint64_t(data_[n]) << (8 * n);
+      } while (data_[n++] & 0x80);
+      data_ += n;
+      size_ -= n;
+      tag    = raw;
+      number = (n == 1 ? raw : compactVarint(raw, ~0ULL)) >> 3;
     }
 
     iterator(const unsigned char* data, size_t size)
@@ -73,21 +144,21 @@ struct PBView
     }
     bool operator!=(const sentinel&) const
     {
-      return size_ != 0;
+      return !done;
     }
     bool operator==(const sentinel&) const
     {
-      return size_ == 0;
+      return done;
     }
     iterator& operator++()
     {
       size_ -= length;
       data_ += length;
-      if (size_)
+      done = size_ == 0;
+      if (!done)
       {
-        size_t v1 = readVarint();
-        type      = wiretype(v1 & 0x7);
-        number    = v1 >> 3;
+        readTag();
+        type = wiretype(tag & 0x7);
         switch (type)
         {
           case Delim:
@@ -100,13 +171,13 @@ struct PBView
             length = 8;
             break;
           case Varint:
-            length = 0;
-            while (length < size_ && data_[length] & 0x80)
-              length++;
-            if (length == size_)
-              throw std::runtime_error("Short packet");
-            length++;
+          {
+            // Decode the value right away; read() hands it out without touching the bytes again.
+            const unsigned char* p = data_;
+            value                  = decodeVarint(p, data_ + size_);
+            length                 = p - data_;
             break;
+          }
           default:
             throw std::runtime_error("Invalid wiretype");
         }
@@ -121,16 +192,8 @@ struct PBView
       switch (type)
       {
         case Varint:
-        {
-          size_t n = 0;
-          while (data_[n] & 0x80)
-          {
-            val |= ((data_[n]) & 0x7F) << (n * 7);
-            n++;
-          }
-          val |= ((data_[n]) & 0x7F) << (n * 7);
+          val = value;
           break;
-        }
         case U64:
         {
           for (size_t n = 0; n < 8; n++)
@@ -160,6 +223,34 @@ struct PBView
     {
       return std::string(data_, data_ + length);
     }
+    // Copies that allocate from the given resource, for --pmr generated code.
+    std::pmr::vector<uint8_t> readBytes(std::pmr::memory_resource& arena)
+    {
+      return std::pmr::vector<uint8_t>(data_, data_ + length, &arena);
+    }
+    std::pmr::string readString(std::pmr::memory_resource& arena)
+    {
+      return std::pmr::string(data_, data_ + length, &arena);
+    }
+    // Overwrite an existing string or vector, keeping its capacity; for decode_into().
+    template <typename S>
+    void readStringInto(S& value)
+    {
+      value.assign((const char*)data_, length);
+    }
+    template <typename B>
+    void readBytesInto(B& value)
+    {
+      value.assign(data_, data_ + length);
+    }
+    std::span<const uint8_t> readBytesView()
+    {
+      return { data_, length };
+    }
+    std::string_view readStringView()
+    {
+      return { (const char*)data_, length };
+    }
     double readDouble()
     {
       uint64_t val = 0;
@@ -193,6 +284,59 @@ struct PBView
     {
       return PBView{ data_, length };
     }
+    template <typename T, typename A>
+    void readPackedFixed(std::vector<T, A>& out)
+    {
+      if (length % sizeof(T))
+        throw std::runtime_error("Invalid packed length");
+      // An empty vector may have no storage, and memcpy must not be handed a null pointer.
+      if (length == 0)
+        return;
+      size_t old = out.size();
+      out.resize(old + length / sizeof(T));
+      if constexpr (std::endian::native == std::endian::little)
+      {
+        memcpy((void*)(out.data() + old), data_, length);
+      }
+      else
+      {
+        for (size_t n = 0; n < length / sizeof(T); n++)
+        {
+          std::conditional_t<sizeof(T) == 8, uint64_t, uint32_t> val = 0;
+          for (size_t b = 0; b < sizeof(T); b++)
+            val |= decltype(val)(data_[n * sizeof(T) + b]) << (8 * b);
+          memcpy((void*)(out.data() + old + n), &val, sizeof(T));
+        }
+      }
+    }
+    template <typename T, typename A>
+    void readPackedVarint(std::vector<T, A>& out)
+    {
+      readPacked<false>(out);
+    }
+    template <typename T, typename A>
+    void readPackedZigZag(std::vector<T, A>& out)
+    {
+      readPacked<true>(out);
+    }
+
+  private:
+    template <bool ZigZag, typename T, typename A>
+    void readPacked(std::vector<T, A>& out)
+    {
+      if (length == 0)
+        return;
+      if (data_[length - 1] & 0x80)
+        throw std::runtime_error("Short packet");
+      // Every varint ends in exactly one byte without the continuation bit.
+      size_t count = 0;
+      for (size_t n = 0; n < length; n++)
+        count += (data_[n] & 0x80) == 0;
+      size_t old = out.size();
+      out.resize(old + count);
+      auto it = out.begin() + old;
+      decodeVarints(data_, data_ + length, [&](uint64_t v) { *it++ = fromVarint<ZigZag, T>(v); });
+    }
   };
   iterator begin()
   {
@@ -204,88 +348,1790 @@ struct PBView
   }
 };
 
-class PBVector : public std::vector<uint8_t>
+// Incremental parser for a message that arrives in pieces, e.g. from a socket. feed() takes
+// chunks of any size and keeps partial tags, varints and length-delimited fields across calls.
+// Each complete field is passed to onField() as the same entry a PBView loop yields. For every
+// length-delimited field, onLengthDelim() decides whether it is buffered and passed on whole,
+// parsed further as a submessage whose fields follow (closed by onEnd()), or skipped unread.
+class PBPushParser
 {
 public:
-  void writeVarint(uint64_t value)
+  enum Action
+  {
+    Buffer,
+    Enter,
+    Skip
+  };
+  // Length-delimited fields larger than maxBuffered are rejected instead of being buffered.
+  explicit PBPushParser(size_t maxBuffered = SIZE_MAX)
+    : maxBuffered_(maxBuffered)
+  {
+  }
+  virtual ~PBPushParser() = default;
+  void feed(std::span<const uint8_t> chunk)
   {
-    while (value > 0x7F)
+    const unsigned char* p   = chunk.data();
+    const unsigned char* end = p + chunk.size();
+    while (p != end)
     {
-      push_back((value & 0x7F) | 0x80);
-      value >>= 7;
+      if (skip_)
+      {
+        size_t n = std::min<uint64_t>(skip_, end - p);
+        p += n;
+        skip_ -= n;
+        offset_ += n;
+        if (!skip_)
+          closeFrames();
+      }
+      else if (want_)
+      {
+        size_t n = std::min<uint64_t>(want_, end - p);
+        pending_.insert(pending_.end(), p, p + n);
+        p += n;
+        want_ -= n;
+        offset_ += n;
+        if (!want_)
+        {
+          emit(pending_.data(), pending_.size());
+          pending_.clear();
+          closeFrames();
+        }
+      }
+      else if (headLen_)
+      {
+        // Complete a header that was cut off by the end of the previous chunk.
+        size_t old = headLen_;
+        size_t n   = std::min<size_t>(sizeof(head_) - old, end - p);
+        memcpy(head_ + old, p, n);
+        size_t header = parseHeader(head_, head_ + old + n);
+        if (!header)
+        {
+          headLen_ += n;
+          return;
+        }
+        headLen_ = 0;
+        p += header - old;
+        field(head_, header, p, end);
+      }
+      else
+      {
+        size_t header = parseHeader(p, end);
+        if (!header)
+        {
+          headLen_ = end - p;
+          memcpy(head_, p, headLen_);
+          return;
+        }
+        const unsigned char* start = p;
+        p += header;
+        field(start, header, p, end);
+      }
     }
-    push_back((uint8_t)value);
   }
-  void addData(wiretype wt, size_t number, const std::vector<uint8_t>& data)
+  // Call after the last chunk; throws if the message stopped in the middle of a field.
+  void finish()
   {
-    if (data.empty())
-      return;
-    writeVarint((number << 3) | wt);
-    if (wt == Delim)
-      writeVarint(data.size());
-    insert(end(), data.begin(), data.end());
+    bool complete = !headLen_ && !skip_ && !want_ && frames_.empty();
+    reset();
+    if (!complete)
+      throw std::runtime_error("Short packet");
   }
-  void addVarint(size_t number, uint64_t value, bool addEvenIfZero = false)
+  void reset()
   {
-    if (!addEvenIfZero && value == 0)
-      return;
-    PBVector v;
-    v.writeVarint(value);
-    addData(Varint, number, v);
+    headLen_ = 0;
+    skip_    = 0;
+    want_    = 0;
+    offset_  = 0;
+    pending_.clear();
+    frames_.clear();
   }
-  void addLengthDelim(size_t number, const std::vector<uint8_t>& value)
+  // Number of entered submessages around the field being reported.
+  size_t depth() const
   {
-    addData(Delim, number, value);
+    return frames_.size();
   }
-  void addLengthDelim(size_t number, const std::string& value)
+
+protected:
+  virtual void   onField(PBView::iterator& entry) = 0;
+  virtual Action onLengthDelim(uint32_t number, size_t length)
   {
-    addData(Delim, number, std::vector<uint8_t>(value.data(), value.data() + value.size()));
+    (void)number;
+    (void)length;
+    return Buffer;
   }
-  void addInt64(size_t number, uint64_t value)
+  virtual void onEnd(uint32_t number)
   {
-    if (value == 0)
-      return;
-    std::vector<uint8_t> v;
-    for (size_t n = 0; n < 8; n++)
+    (void)number;
+  }
+
+private:
+  // Length of the varint at p, or 0 if it does not end before `end`.
+  static size_t varintLength(const unsigned char* p, const unsigned char* end, size_t max)
+  {
+    for (size_t n = 0; n < max; n++)
     {
-      v.push_back(value & 0xFF);
-      value >>= 8;
+      if (p + n == end)
+        return 0;
+      if (!(p[n] & 0x80))
+        return n + 1;
     }
-    addData(U64, number, v);
+    throw std::runtime_error("Invalid varint");
   }
-  void addInt32(size_t number, uint32_t value)
+  // Size of the field header at p: the tag plus either the whole scalar value or the length
+  // prefix. Returns 0 if it is not complete yet.
+  size_t parseHeader(const unsigned char* p, const unsigned char* end)
   {
-    if (value == 0)
+    size_t tag = varintLength(p, end, 5);
+    if (!tag)
+      return 0;
+    switch (wiretype(p[0] & 7))
+    {
+      case Varint:
+      {
+        size_t value = varintLength(p + tag, end, 10);
+        return value ? tag + value : 0;
+      }
+      case U32:
+        return end - p >= ptrdiff_t(tag + 4) ? tag + 4 : 0;
+      case U64:
+        return end - p >= ptrdiff_t(tag + 8) ? tag + 8 : 0;
+      case Delim:
+      {
+        size_t prefix = varintLength(p + tag, end, 10);
+        return prefix ? tag + prefix : 0;
+      }
+      default:
+        throw std::runtime_error("Invalid wiretype");
+    }
+  }
+  // Handles a complete header at [start, start + header); [p, end) is the rest of the chunk.
+  void field(const unsigned char* start, size_t header, const unsigned char*& p, const unsigned char* end)
+  {
+    offset_ += header;
+    if (wiretype(start[0] & 7) != Delim)
+    {
+      checkFrame(offset_);
+      emit(start, header);
+      closeFrames();
       return;
-    std::vector<uint8_t> v;
-    for (size_t n = 0; n < 4; n++)
+    }
+    const unsigned char* q      = start;
+    uint32_t             number = uint32_t(decodeVarint(q, start + header) >> 3);
+    uint64_t             length = decodeVarint(q, start + header);
+    checkFrame(offset_ + length);
+    switch (onLengthDelim(number, length))
     {
-      v.push_back(value & 0xFF);
-      value >>= 8;
+      case Buffer:
+        if (length > maxBuffered_)
+          throw std::runtime_error("Field too large");
+        if (uint64_t(end - p) >= length)
+        {
+          // The whole field is in this chunk, so it is passed on without a copy.
+          if (start + header == p)
+          {
+            emit(start, header + length);
+          }
+          else
+          {
+            pending_.assign(start, start + header);
+            pending_.insert(pending_.end(), p, p + length);
+            emit(pending_.data(), pending_.size());
+            pending_.clear();
+          }
+          p += length;
+          offset_ += length;
+          closeFrames();
+        }
+        else
+        {
+          pending_.assign(start, start + header);
+          want_ = length;
+        }
+        break;
+      case Enter:
+        frames_.push_back({ number, offset_ + length });
+        closeFrames();
+        break;
+      case Skip:
+        skip_ = length;
+        if (!skip_)
+          closeFrames();
+        break;
     }
-    addData(U32, number, v);
   }
-  void addFloat(size_t number, float value)
+  void emit(const unsigned char* data, size_t size)
   {
-    std::vector<uint8_t> v;
-    v.resize(4);
-    memcpy(v.data(), &value, 4);
-    addData(U32, number, v);
+    PBView::iterator entry(data, size);
+    onField(entry);
   }
-  void addDouble(size_t number, double value)
+  void checkFrame(uint64_t fieldEnd)
+  {
+    if (!frames_.empty() && fieldEnd > frames_.back().end)
+      throw std::runtime_error("Invalid submessage length");
+  }
+  void closeFrames()
+  {
+    while (!frames_.empty() && frames_.back().end == offset_)
+    {
+      uint32_t number = frames_.back().number;
+      frames_.pop_back();
+      onEnd(number);
+    }
+  }
+
+  struct Frame
+  {
+    uint32_t number;
+    uint64_t end;
+  };
+  size_t               maxBuffered_;
+  unsigned char        head_[15];
+  size_t               headLen_ = 0;
+  uint64_t             skip_    = 0;
+  uint64_t             want_    = 0;
+  uint64_t             offset_  = 0;
+  std::vector<uint8_t> pending_;
+  std::vector<Frame>   frames_;
+};
+
+// Sizes of nested messages, recorded in pre-order by byte_size() so that the encoder can write
+// each length prefix without sizing the submessage again.
+struct PBSizes
+{
+  std::vector<size_t> sizes;
+  size_t              next = 0;
+  size_t              open()
+  {
+    sizes.push_back(0);
+    return sizes.size() - 1;
+  }
+  void close(size_t slot, size_t size)
   {
-    std::vector<uint8_t> v;
-    v.resize(8);
-    memcpy(v.data(), &value, 8);
-    addData(U64, number, v);
+    // An empty submessage is not written, so the encoder must not see the slots of its children.
+    if (size == 0)
+      sizes.resize(slot + 1);
+    sizes[slot] = size;
+  }
+  size_t pop()
+  {
+    return sizes[next++];
+  }
+  void clear()
+  {
+    sizes.clear();
+    next = 0;
   }
 };
 
+class PBWriter;
+
+template <typename T>
+size_t byte_size(const T&, PBSizes* sizes = nullptr);
+
+template <typename T>
+void encode(PBWriter&, const T&, PBSizes&);
+
+// Sizes and encodes only the fields whose bits are set in `fields`, as if the others were
+// empty. Fields past the first 64 are always included. The same mask must be passed to both.
+template <typename T>
+size_t byte_size(const T&, PBSizes* sizes, uint64_t fields);
+
+template <typename T>
+void encode(PBWriter&, const T&, PBSizes&, uint64_t fields);
+
 template <typename T>
 T from_protobuf(PBView);
 
+// Decodes only the fields whose bits are set in `fields`, built from the generated T::Fields
+// constants. The others are stepped over by their length without being decoded.
 template <typename T>
-PBVector to_protobuf(const T&);
+T from_protobuf(PBView, uint64_t fields);
+
+template <typename T, uint64_t Fields>
+T from_protobuf(PBView data)
+{
+  return from_protobuf<T>(data, Fields);
+}
 
+// Decodes into an existing object, replacing everything it held. Strings and vectors keep their
+// capacity, and so do the elements of repeated strings, bytes and submessages, which are decoded
+// over rather than rebuilt; only elements past the new length are freed. Reusing one object per
+// thread, decoding messages of a similar shape stops allocating after the first few.
 template <typename T>
-inline constexpr bool is_protobuf = false;
+void decode_into(PBView, T&);
+
+// Decodes with every string and container carved out of `arena`; only generated in --pmr mode.
+// With a std::pmr::monotonic_buffer_resource the whole message is released in one go.
+template <typename T>
+T from_protobuf(PBView, std::pmr::memory_resource& arena);
+
+// Decodes onto an existing object without clearing it, as if `data` had been appended to the
+// message it was decoded from: fields that occur are overwritten, repeated fields and maps are
+// added to and submessages are merged. Decoders use it for a submessage that occurs twice.
+template <typename T>
+void merge_from_protobuf(PBView, T&);
+
+// As above, with what is allocated carved out of `arena`; only generated in --pmr mode.
+template <typename T>
+void merge_from_protobuf(PBView, T&, std::pmr::memory_resource& arena);
+
+// Element `used` of a repeated field that decode_into() is filling, appended if the vector is not
+// that long yet. Afterwards the vector is cut back to `used`.
+template <typename V>
+typename V::value_type& pbNext(V& values, size_t& used)
+{
+  if (used == values.size())
+    values.emplace_back();
+  return values[used++];
+}
+
+// Decodes one map entry, a message with the key as field 1 and the value as field 2, and stores
+// it in `map`, replacing an earlier entry with the same key. `field(entry, key, value)` reads one
+// field of the entry; whatever is missing keeps its default. Key and value are built with the
+// map's allocator, so pmr maps take them over without copying.
+template <typename M, typename F>
+void pbReadMapEntry(M& map, PBView data, F&& field)
+{
+  auto key   = std::make_obj_using_allocator<typename M::key_type>(map.get_allocator());
+  auto value = std::make_obj_using_allocator<typename M::mapped_type>(map.get_allocator());
+  for (auto& entry : data)
+    field(entry, key, value);
+  map.insert_or_assign(std::move(key), std::move(value));
+}
+
+// Alternative I of a oneof, made the active one if it is not already; for decode_into(), which
+// decodes over an alternative that is still set from the previous message. std::variant takes no
+// allocator, so a new alternative is built with the default one.
+template <size_t I, typename V>
+std::variant_alternative_t<I, V>& pbAlternative(V& oneof)
+{
+  if (oneof.index() != I)
+    oneof.template emplace<I>();
+  return *std::get_if<I>(&oneof);
+}
+
+// Reads submessage alternative I of a oneof. One that is already set is merged into, as a
+// singular submessage is; otherwise it replaces whatever alternative was set.
+template <size_t I, typename V, typename... Arena>
+void pbMergeAlternative(V& oneof, PBView data, Arena&... arena)
+{
+  if (oneof.index() == I)
+    merge_from_protobuf(data, *std::get_if<I>(&oneof), arena...);
+  else
+    oneof.template emplace<I>(from_protobuf<std::variant_alternative_t<I, V>>(data, arena...));
+}
+
+// Submessage field that is decoded on first access and cached. Until it is accessed mutably it
+// keeps referring to its encoded bytes, and re-encoding writes those bytes back unchanged, so it
+// must not outlive the buffer it was decoded from. Not safe for concurrent first access.
+template <typename T>
+class Lazy
+{
+public:
+  Lazy() = default;
+  Lazy(T value)
+    : value_(std::move(value))
+    , modified_(true)
+  {
+  }
+  explicit Lazy(PBView bytes)
+    : bytes_(bytes)
+  {
+  }
+  const T& get() const
+  {
+    if (!value_)
+      value_ = from_protobuf<T>(bytes_);
+    return *value_;
+  }
+  T& get()
+  {
+    std::as_const(*this).get();
+    modified_ = true;
+    return *value_;
+  }
+  const T* operator->() const
+  {
+    return &get();
+  }
+  T* operator->()
+  {
+    return &get();
+  }
+  bool decoded() const
+  {
+    return value_.has_value();
+  }
+  bool modified() const
+  {
+    return modified_;
+  }
+  PBView bytes() const
+  {
+    return bytes_;
+  }
+  // Reads another occurrence of the field. The first stays undecoded; a later one is merged into
+  // the decoded value, as for any submessage, and the field is then written from that value.
+  void merge(PBView bytes)
+  {
+    if (!value_ && bytes_.size == 0)
+      bytes_ = bytes;
+    else
+      merge_from_protobuf(bytes, get());
+  }
+
+private:
+  PBView                   bytes_{ nullptr, 0 };
+  mutable std::optional<T> value_;
+  bool                     modified_ = false;
+};
+
+inline size_t tagSize(size_t number)
+{
+  return varintSize(number << 3);
+}
+
+inline size_t sizeVarint(PBTag tag, uint64_t value, bool addEvenIfZero = false)
+{
+  if (!addEvenIfZero && value == 0)
+    return 0;
+  return tag.size + varintSize(value);
+}
+
+template <typename T>
+size_t sizeLengthDelim(PBTag tag, const T& value, bool addEvenIfZero = false)
+{
+  if (!addEvenIfZero && value.empty())
+    return 0;
+  return tag.size + varintSize(value.size()) + value.size();
+}
+
+inline size_t sizeInt64(PBTag tag, uint64_t value, bool addEvenIfZero = false)
+{
+  return value || addEvenIfZero ? tag.size + 8 : 0;
+}
+
+inline size_t sizeInt32(PBTag tag, uint32_t value, bool addEvenIfZero = false)
+{
+  return value || addEvenIfZero ? tag.size + 4 : 0;
+}
+
+inline size_t sizeFloat(PBTag tag, float)
+{
+  return tag.size + 4;
+}
+
+inline size_t sizeDouble(PBTag tag, double)
+{
+  return tag.size + 8;
+}
+
+template <typename T>
+size_t sizeMessage(PBTag tag, const T& value, PBSizes* sizes, bool addEvenIfZero = false)
+{
+  size_t size;
+  if (sizes)
+  {
+    size_t slot = sizes->open();
+    size        = byte_size(value, sizes);
+    sizes->close(slot, size);
+  }
+  else
+  {
+    size = byte_size(value);
+  }
+  return size || addEvenIfZero ? tag.size + varintSize(size) + size : 0;
+}
+
+template <typename T>
+size_t sizeMessage(PBTag tag, const Lazy<T>& value, PBSizes* sizes)
+{
+  if (value.modified())
+    return sizeMessage(tag, value.get(), sizes);
+  size_t size = value.bytes().size;
+  return size ? tag.size + varintSize(size) + size : 0;
+}
+
+// Map entries are written even when key and value are both defaults and the entry is empty, so
+// unlike other submessages every entry gets a slot in `sizes`. `entry()` sizes key and value.
+template <typename F>
+size_t sizeMapEntry(PBTag tag, PBSizes* sizes, F&& entry)
+{
+  size_t size;
+  if (sizes)
+  {
+    size_t slot = sizes->open();
+    size        = entry();
+    sizes->close(slot, size);
+  }
+  else
+  {
+    size = entry();
+  }
+  return tag.size + varintSize(size) + size;
+}
+
+template <typename T, typename A>
+size_t sizePackedFixed(PBTag tag, const std::vector<T, A>& values)
+{
+  if (values.empty())
+    return 0;
+  size_t size = values.size() * sizeof(T);
+  return tag.size + varintSize(size) + size;
+}
+
+template <bool ZigZag, typename T, typename A>
+size_t sizePacked(PBTag tag, const std::vector<T, A>& values, PBSizes* sizes)
+{
+  size_t size = 0;
+  for (auto v : values)
+    size += varintSize(toVarint<ZigZag>(v));
+  if (sizes)
+    sizes->close(sizes->open(), size);
+  return size ? tag.size + varintSize(size) + size : 0;
+}
+
+template <typename T, typename A>
+size_t sizePackedVarint(PBTag tag, const std::vector<T, A>& values, PBSizes* sizes)
+{
+  return sizePacked<false>(tag, values, sizes);
+}
+
+template <typename T, typename A>
+size_t sizePackedZigZag(PBTag tag, const std::vector<T, A>& values, PBSizes* sizes)
+{
+  return sizePacked<true>(tag, values, sizes);
+}
+
+class PBVector : public std::vector<uint8_t>
+{
+public:
+  void writeVarint(uint64_t value)
+  {
+    uint8_t bytes[10];
+    insert(end(), bytes, encodeVarint(bytes, value));
+  }
+  void writeTag(size_t number, wiretype wt)
+  {
+    writeVarint((number << 3) | wt);
+  }
+  void writeFixed32(uint32_t value)
+  {
+    uint8_t bytes[4];
+    for (size_t n = 0; n < 4; n++)
+    {
+      bytes[n] = value & 0xFF;
+      value >>= 8;
+    }
+    insert(end(), bytes, bytes + 4);
+  }
+  void writeFixed64(uint64_t value)
+  {
+    uint8_t bytes[8];
+    for (size_t n = 0; n < 8; n++)
+    {
+      bytes[n] = value & 0xFF;
+      value >>= 8;
+    }
+    insert(end(), bytes, bytes + 8);
+  }
+  void addData(wiretype wt, size_t number, const uint8_t* data, size_t length)
+  {
+    if (length == 0)
+      return;
+    writeTag(number, wt);
+    if (wt == Delim)
+      writeVarint(length);
+    insert(end(), data, data + length);
+  }
+  void addData(wiretype wt, size_t number, const std::vector<uint8_t>& data)
+  {
+    addData(wt, number, data.data(), data.size());
+  }
+  void addVarint(size_t number, uint64_t value, bool addEvenIfZero = false)
+  {
+    if (!addEvenIfZero && value == 0)
+      return;
+    writeTag(number, Varint);
+    writeVarint(value);
+  }
+  void addLengthDelim(size_t number, const std::vector<uint8_t>& value)
+  {
+    addData(Delim, number, value.data(), value.size());
+  }
+  void addLengthDelim(size_t number, const std::string& value)
+  {
+    addData(Delim, number, (const uint8_t*)value.data(), value.size());
+  }
+  void addInt64(size_t number, uint64_t value)
+  {
+    if (value == 0)
+      return;
+    writeTag(number, U64);
+    writeFixed64(value);
+  }
+  void addInt32(size_t number, uint32_t value)
+  {
+    if (value == 0)
+      return;
+    writeTag(number, U32);
+    writeFixed32(value);
+  }
+  void addFloat(size_t number, float value)
+  {
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    writeTag(number, U32);
+    writeFixed32(bits);
+  }
+  void addDouble(size_t number, double value)
+  {
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    writeTag(number, U64);
+    writeFixed64(bits);
+  }
+};
+
+// Output window that generated encoders write into. Subclasses decide where the bytes go by
+// refilling the window in overflow() when it runs out of space.
+class PBWriter
+{
+public:
+  virtual ~PBWriter() = default;
+  // Total number of bytes written so far.
+  size_t size() const
+  {
+    return flushed_ + (cur_ - begin_);
+  }
+  // Hint that `size` more bytes are about to be written.
+  virtual void reserve(size_t) {}
+  void writeVarint(uint64_t value)
+  {
+    if (size_t(end_ - cur_) < 10)
+    {
+      // Near the end of the window only the exact size is guaranteed to fit.
+      ensure(varintSize(value));
+      if (size_t(end_ - cur_) < 10)
+      {
+        cur_ = encodeVarintSlow(cur_, value);
+        return;
+      }
+    }
+    cur_ = encodeVarint(cur_, value);
+  }
+  void writeTag(PBTag tag)
+  {
+    if constexpr (std::endian::native == std::endian::little)
+    {
+      if (size_t(end_ - cur_) >= 8)
+      {
+        memcpy(cur_, &tag.bytes, 8);
+        cur_ += tag.size;
+        return;
+      }
+    }
+    ensure(tag.size);
+    for (size_t n = 0; n < tag.size; n++)
+      *cur_++ = uint8_t(tag.bytes >> (8 * n));
+  }
+  void writeFixed32(uint32_t value)
+  {
+    ensure(4);
+    for (size_t n = 0; n < 4; n++)
+    {
+      *cur_++ = value & 0xFF;
+      value >>= 8;
+    }
+  }
+  void writeFixed64(uint64_t value)
+  {
+    ensure(8);
+    for (size_t n = 0; n < 8; n++)
+    {
+      *cur_++ = value & 0xFF;
+      value >>= 8;
+    }
+  }
+  void writeBytes(const uint8_t* data, size_t length)
+  {
+    if (size_t(end_ - cur_) < length || length >= largeBytes_)
+    {
+      writeLarge(data, length);
+      return;
+    }
+    memcpy(cur_, data, length);
+    cur_ += length;
+  }
+  void addData(PBTag tag, const uint8_t* data, size_t length)
+  {
+    if (length == 0)
+      return;
+    writeTag(tag);
+    if (tag.type() == Delim)
+      writeVarint(length);
+    writeBytes(data, length);
+  }
+  void addVarint(PBTag tag, uint64_t value, bool addEvenIfZero = false)
+  {
+    if (!addEvenIfZero && value == 0)
+      return;
+    writeTag(tag);
+    writeVarint(value);
+  }
+  void addLengthDelim(PBTag tag, std::span<const uint8_t> value, bool addEvenIfZero = false)
+  {
+    if (addEvenIfZero && value.empty())
+    {
+      writeTag(tag);
+      writeVarint(0);
+      return;
+    }
+    addData(tag, value.data(), value.size());
+  }
+  void addLengthDelim(PBTag tag, std::string_view value, bool addEvenIfZero = false)
+  {
+    addLengthDelim(tag, std::span((const uint8_t*)value.data(), value.size()), addEvenIfZero);
+  }
+  void addInt64(PBTag tag, uint64_t value, bool addEvenIfZero = false)
+  {
+    if (!addEvenIfZero && value == 0)
+      return;
+    writeTag(tag);
+    writeFixed64(value);
+  }
+  void addInt32(PBTag tag, uint32_t value, bool addEvenIfZero = false)
+  {
+    if (!addEvenIfZero && value == 0)
+      return;
+    writeTag(tag);
+    writeFixed32(value);
+  }
+  void addFloat(PBTag tag, float value)
+  {
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    writeTag(tag);
+    writeFixed32(bits);
+  }
+  void addDouble(PBTag tag, double value)
+  {
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    writeTag(tag);
+    writeFixed64(bits);
+  }
+  // An empty submessage has no slots for its children, so it is never encoded, only announced.
+  template <typename T>
+  void addMessage(PBTag tag, const T& value, PBSizes& sizes, bool addEvenIfZero = false)
+  {
+    size_t size = sizes.pop();
+    if (size == 0 && !addEvenIfZero)
+      return;
+    writeTag(tag);
+    writeVarint(size);
+    if (size)
+      encode(*this, value, sizes);
+  }
+  template <typename T>
+  void addMessage(PBTag tag, const Lazy<T>& value, PBSizes& sizes)
+  {
+    if (value.modified())
+      return addMessage(tag, value.get(), sizes);
+    addData(tag, value.bytes().data, value.bytes().size);
+  }
+  // Writes the header of a map entry sized by sizeMapEntry(); `entry()` then writes key and value.
+  template <typename F>
+  void addMapEntry(PBTag tag, PBSizes& sizes, F&& entry)
+  {
+    writeTag(tag);
+    writeVarint(sizes.pop());
+    entry();
+  }
+  template <typename T, typename A>
+  void addPackedFixed(PBTag tag, const std::vector<T, A>& values)
+  {
+    if (values.empty())
+      return;
+    writeTag(tag);
+    writeVarint(values.size() * sizeof(T));
+    if constexpr (std::endian::native == std::endian::little)
+    {
+      writeBytes((const uint8_t*)values.data(), values.size() * sizeof(T));
+    }
+    else
+    {
+      for (auto v : values)
+      {
+        std::conditional_t<sizeof(T) == 8, uint64_t, uint32_t> bits;
+        memcpy(&bits, &v, sizeof(T));
+        if constexpr (sizeof(T) == 8)
+          writeFixed64(bits);
+        else
+          writeFixed32(bits);
+      }
+    }
+  }
+  template <typename T, typename A>
+  void addPackedVarint(PBTag tag, const std::vector<T, A>& values, PBSizes& sizes)
+  {
+    addPacked<false>(tag, values, sizes);
+  }
+  template <typename T, typename A>
+  void addPackedZigZag(PBTag tag, const std::vector<T, A>& values, PBSizes& sizes)
+  {
+    addPacked<true>(tag, values, sizes);
+  }
+  // Scratch space for byte_size(), kept here so it is reused across messages.
+  PBSizes sizes;
+
+protected:
+  template <bool ZigZag, typename T, typename A>
+  void addPacked(PBTag tag, const std::vector<T, A>& values, PBSizes& sizes)
+  {
+    size_t size = sizes.pop();
+    if (size == 0)
+      return;
+    writeTag(tag);
+    writeVarint(size);
+    auto it = values.begin();
+    while (it != values.end())
+    {
+      size_t room = std::min<size_t>(size_t(end_ - cur_) / 10, values.end() - it);
+      if (room == 0)
+      {
+        writeVarint(toVarint<ZigZag>(*it++));
+        continue;
+      }
+      cur_ = encodeVarints<ZigZag>(cur_, it, it + room);
+      it += room;
+    }
+  }
+  void ensure(size_t needed)
+  {
+    if (size_t(end_ - cur_) < needed)
+      overflow(needed);
+  }
+  // Make room for at least `needed` more bytes in the window.
+  virtual void overflow(size_t needed) = 0;
+  virtual void writeLarge(const uint8_t* data, size_t length)
+  {
+    overflow(length);
+    memcpy(cur_, data, length);
+    cur_ += length;
+  }
+  uint8_t* begin_   = nullptr;
+  uint8_t* cur_     = nullptr;
+  uint8_t* end_     = nullptr;
+  size_t   flushed_ = 0;
+  // Payloads of at least this many bytes go to writeLarge() even when they would fit.
+  size_t largeBytes_ = SIZE_MAX;
+};
+
+// Writes into a caller-provided buffer of fixed size.
+class PBSpanWriter : public PBWriter
+{
+public:
+  PBSpanWriter(std::span<uint8_t> buffer)
+  {
+    begin_ = cur_ = buffer.data();
+    end_          = begin_ + buffer.size();
+  }
+
+protected:
+  void overflow(size_t) override
+  {
+    throw std::length_error("Short buffer");
+  }
+};
+
+// Growable buffer that keeps its capacity across clear(), so one instance can be reused for
+// every message sent on a connection.
+class PBBuffer : public PBWriter
+{
+public:
+  PBBuffer() = default;
+  PBBuffer(const PBBuffer&)            = delete;
+  PBBuffer& operator=(const PBBuffer&) = delete;
+  const uint8_t* data() const
+  {
+    return begin_;
+  }
+  std::span<const uint8_t> span() const
+  {
+    return { begin_, size() };
+  }
+  void clear()
+  {
+    cur_ = begin_;
+  }
+  void reserve(size_t size) override
+  {
+    if (size_t(end_ - cur_) < size)
+      grow(this->size() + size);
+  }
+
+protected:
+  void overflow(size_t needed) override
+  {
+    grow(std::max<size_t>(2 * size_t(end_ - begin_), size() + needed));
+  }
+
+private:
+  void grow(size_t capacity)
+  {
+    auto   storage = std::make_unique_for_overwrite<uint8_t[]>(capacity);
+    size_t used    = size();
+    if (used)
+      memcpy(storage.get(), begin_, used);
+    storage_ = std::move(storage);
+    begin_   = storage_.get();
+    cur_     = begin_ + used;
+    end_     = begin_ + capacity;
+  }
+  std::unique_ptr<uint8_t[]> storage_;
+};
+
+// Collects output in a fixed-size chunk and hands each full chunk to sink(). Payloads larger
+// than the chunk are passed to sink() directly. Call flush() after the last message.
+class PBChunkedWriter : public PBWriter
+{
+public:
+  explicit PBChunkedWriter(size_t chunkSize = 65536)
+    : chunk_(std::max<size_t>(chunkSize, 32))
+  {
+    begin_ = cur_ = chunk_.data();
+    end_          = begin_ + chunk_.size();
+  }
+  void flush()
+  {
+    if (cur_ == begin_)
+      return;
+    sink(begin_, cur_ - begin_);
+    flushed_ += cur_ - begin_;
+    cur_ = begin_;
+  }
+
+protected:
+  virtual void sink(const uint8_t* data, size_t length) = 0;
+  void overflow(size_t) override
+  {
+    flush();
+  }
+  void writeLarge(const uint8_t* data, size_t length) override
+  {
+    flush();
+    sink(data, length);
+    flushed_ += length;
+  }
+
+private:
+  std::vector<uint8_t> chunk_;
+};
+
+class PBStreamWriter : public PBChunkedWriter
+{
+public:
+  explicit PBStreamWriter(std::ostream& os, size_t chunkSize = 65536)
+    : PBChunkedWriter(chunkSize)
+    , os(os)
+  {
+  }
+  ~PBStreamWriter()
+  {
+    flush();
+  }
+
+protected:
+  void sink(const uint8_t* data, size_t length) override
+  {
+    os.write((const char*)data, length);
+  }
+
+private:
+  std::ostream& os;
+};
+
+#if __has_include(<unistd.h>)
+class PBFdWriter : public PBChunkedWriter
+{
+public:
+  explicit PBFdWriter(int fd, size_t chunkSize = 65536)
+    : PBChunkedWriter(chunkSize)
+    , fd(fd)
+  {
+  }
+  ~PBFdWriter()
+  {
+    try
+    {
+      flush();
+    }
+    catch (std::exception&)
+    {
+    }
+  }
+
+protected:
+  void sink(const uint8_t* data, size_t length) override
+  {
+    while (length)
+    {
+      ssize_t n = ::write(fd, data, length);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        throw std::system_error(errno, std::generic_category(), "write");
+      }
+      data += n;
+      length -= n;
+    }
+  }
+
+private:
+  int fd;
+};
+#endif
+
+#if __has_include(<sys/uio.h>)
+// Encodes into a list of segments for writev() or sendmsg(). Fields are written to a scratch
+// buffer, but payloads of at least `largeBytes` (strings, bytes, packed fixed arrays, unmodified
+// lazy submessages) are referenced where they are instead of being copied. The segments point
+// into the encoded object, which must stay alive and unchanged until they have been sent.
+// clear() keeps the scratch buffer for the next message.
+class PBIovecWriter : public PBWriter
+{
+public:
+  explicit PBIovecWriter(size_t largeBytes = 4096)
+  {
+    largeBytes_ = std::max<size_t>(largeBytes, 1);
+  }
+  void clear()
+  {
+    pieces_.clear();
+    cur_     = begin_;
+    flushed_ = 0;
+    mark_    = 0;
+  }
+  std::span<const iovec> iovecs()
+  {
+    iovecs_.clear();
+    for (auto& piece : pieces_)
+      iovecs_.push_back({ (void*)(piece.data ? piece.data : begin_ + piece.offset), piece.length });
+    if (size_t(cur_ - begin_) > mark_)
+      iovecs_.push_back({ begin_ + mark_, size_t(cur_ - begin_) - mark_ });
+    return iovecs_;
+  }
+  // Writes every segment to fd, retrying after short writes.
+  void writeTo(int fd)
+  {
+    auto   all  = iovecs();
+    size_t done = 0;
+    while (done < all.size())
+    {
+      ssize_t n = ::writev(fd, &iovecs_[done], int(std::min<size_t>(all.size() - done, IOV_MAX)));
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        throw std::system_error(errno, std::generic_category(), "writev");
+      }
+      for (; done < all.size() && size_t(n) >= iovecs_[done].iov_len; done++)
+        n -= iovecs_[done].iov_len;
+      if (n)
+      {
+        iovecs_[done].iov_base = (uint8_t*)iovecs_[done].iov_base + n;
+        iovecs_[done].iov_len -= n;
+      }
+    }
+  }
+
+protected:
+  void overflow(size_t needed) override
+  {
+    // Scratch segments are kept as offsets, so the buffer is free to move.
+    size_t used     = cur_ - begin_;
+    size_t capacity = std::max<size_t>({ 2 * size_t(end_ - begin_), used + needed, 256 });
+    auto   storage  = std::make_unique_for_overwrite<uint8_t[]>(capacity);
+    if (used)
+      memcpy(storage.get(), begin_, used);
+    storage_ = std::move(storage);
+    begin_   = storage_.get();
+    cur_     = begin_ + used;
+    end_     = begin_ + capacity;
+  }
+  void writeLarge(const uint8_t* data, size_t length) override
+  {
+    if (length < largeBytes_)
+      return PBWriter::writeLarge(data, length);
+    size_t used = cur_ - begin_;
+    if (used > mark_)
+      pieces_.push_back({ nullptr, mark_, used - mark_ });
+    pieces_.push_back({ data, 0, length });
+    mark_ = used;
+    flushed_ += length;
+  }
+
+private:
+  // A run of the scratch buffer when data is null, otherwise an aliased payload.
+  struct Piece
+  {
+    const uint8_t* data;
+    size_t         offset;
+    size_t         length;
+  };
+  std::unique_ptr<uint8_t[]> storage_;
+  std::vector<Piece>         pieces_;
+  std::vector<iovec>         iovecs_;
+  size_t                     mark_ = 0;
+};
+#endif
+
+template <typename T>
+void to_protobuf(const T& in, PBWriter& out)
+{
+  out.sizes.clear();
+  out.reserve(byte_size(in, &out.sizes));
+  encode(out, in, out.sizes);
+}
+
+// Returns the number of bytes written, or nothing if `out` is too small to hold the message.
+template <typename T>
+std::optional<size_t> to_protobuf(const T& in, std::span<uint8_t> out)
+{
+  PBSpanWriter writer(out);
+  size_t       size = byte_size(in, &writer.sizes);
+  if (size > out.size())
+    return std::nullopt;
+  encode(writer, in, writer.sizes);
+  return size;
+}
+
+template <typename T>
+PBVector to_protobuf(const T& in)
+{
+  PBSizes  sizes;
+  PBVector vec;
+  vec.resize(byte_size(in, &sizes));
+  PBSpanWriter writer(vec);
+  encode(writer, in, sizes);
+  return vec;
+}
+
+// Appends messages one after another, each preceded by its length as a varint (the framing of
+// writeDelimitedTo() in other protobuf libraries). If `index` is given, the file offset of every
+// record is written to it as a fixed64, so PBRecordFile can seek to record n directly. When
+// appending to an existing file, `offset` is the position at which `out` starts writing.
+class PBRecordWriter
+{
+public:
+  explicit PBRecordWriter(PBWriter& out, PBWriter* index = nullptr, uint64_t offset = 0)
+    : out_(out)
+    , index_(index)
+    , base_(offset - out.size())
+  {
+  }
+  template <typename T>
+  void append(const T& in)
+  {
+    if (index_)
+      index_->writeFixed64(base_ + out_.size());
+    out_.sizes.clear();
+    size_t size = byte_size(in, &out_.sizes);
+    out_.reserve(varintSize(size) + size);
+    out_.writeVarint(size);
+    encode(out_, in, out_.sizes);
+  }
+  // Appends a message that is already encoded.
+  void append(PBView message)
+  {
+    if (index_)
+      index_->writeFixed64(base_ + out_.size());
+    out_.reserve(varintSize(message.size) + message.size);
+    out_.writeVarint(message.size);
+    out_.writeBytes(message.data, message.size);
+  }
+
+private:
+  PBWriter& out_;
+  PBWriter* index_;
+  uint64_t  base_;
+};
+
+// Length-prefixed records in memory. Iterating yields a PBView of each record without copying.
+struct PBRecords
+{
+  PBRecords(const unsigned char* dat, size_t siz)
+    : data(dat)
+    , size(siz)
+  {
+  }
+  template <typename T>
+    requires(!std::is_same_v<std::remove_cvref_t<T>, PBRecords>)
+  PBRecords(T&& container)
+    : data((const unsigned char*)container.data())
+    , size(container.size())
+  {
+  }
+  // Reads the record at p and advances p past it.
+  static PBView read(const unsigned char*& p, const unsigned char* end)
+  {
+    uint64_t length = decodeVarint(p, end);
+    if (length > uint64_t(end - p))
+      throw std::runtime_error("Short packet");
+    PBView record(p, length);
+    p += length;
+    return record;
+  }
+  const unsigned char* data;
+  size_t               size;
+  class sentinel
+  {
+  };
+  struct iterator
+  {
+    iterator(const unsigned char* data, size_t size)
+      : next_(data)
+      , end_(data + size)
+    {
+      ++(*this);
+    }
+    PBView operator*() const
+    {
+      return record_;
+    }
+    bool operator!=(const sentinel&) const
+    {
+      return record_.data != nullptr;
+    }
+    bool operator==(const sentinel&) const
+    {
+      return record_.data == nullptr;
+    }
+    iterator& operator++()
+    {
+      record_ = next_ == end_ ? PBView(nullptr, 0) : read(next_, end_);
+      return *this;
+    }
+
+  private:
+    const unsigned char* next_;
+    const unsigned char* end_;
+    PBView               record_{ nullptr, 0 };
+  };
+  iterator begin() const
+  {
+    return iterator(data, size);
+  }
+  sentinel end() const
+  {
+    return {};
+  }
+};
+
+#if __has_include(<sys/mman.h>)
+// Read-only mapping of a whole file.
+class PBMappedFile
+{
+public:
+  explicit PBMappedFile(const std::string& path)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(), "open " + path);
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+      int err = errno;
+      ::close(fd);
+      throw std::system_error(err, std::generic_category(), "fstat " + path);
+    }
+    size_ = st.st_size;
+    if (size_)
+    {
+      void* p   = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      int   err = errno;
+      ::close(fd);
+      if (p == MAP_FAILED)
+        throw std::system_error(err, std::generic_category(), "mmap " + path);
+      data_ = (const unsigned char*)p;
+    }
+    else
+    {
+      ::close(fd);
+    }
+  }
+  PBMappedFile(PBMappedFile&& other)
+    : data_(std::exchange(other.data_, nullptr))
+    , size_(std::exchange(other.size_, 0))
+  {
+  }
+  PBMappedFile& operator=(PBMappedFile&& other)
+  {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+  ~PBMappedFile()
+  {
+    if (data_)
+      munmap((void*)data_, size_);
+  }
+  const unsigned char* data() const
+  {
+    return data_;
+  }
+  size_t size() const
+  {
+    return size_;
+  }
+
+private:
+  const unsigned char* data_ = nullptr;
+  size_t               size_ = 0;
+};
+
+// Record file written by PBRecordWriter, read through a memory mapping. The views it hands out
+// point into the mapping and stay valid as long as the PBRecordFile. Records can be accessed by
+// number once an index is available, either from the sidecar file written alongside the records
+// or from buildIndex().
+class PBRecordFile
+{
+public:
+  explicit PBRecordFile(const std::string& path)
+    : file_(path)
+  {
+  }
+  PBRecordFile(const std::string& path, const std::string& indexPath)
+    : file_(path)
+    , index_(PBMappedFile(indexPath))
+  {
+    if (index_->size() % 8)
+      throw std::runtime_error("Invalid record index");
+  }
+  PBRecords records() const
+  {
+    return { file_.data(), file_.size() };
+  }
+  PBRecords::iterator begin() const
+  {
+    return records().begin();
+  }
+  PBRecords::sentinel end() const
+  {
+    return {};
+  }
+  // Scans the records to find their offsets, for files without a sidecar index.
+  void buildIndex()
+  {
+    index_.reset();
+    offsets_.clear();
+    const unsigned char* p   = file_.data();
+    const unsigned char* end = p + file_.size();
+    while (p != end)
+    {
+      offsets_.push_back(p - file_.data());
+      PBRecords::read(p, end);
+    }
+  }
+  // Writes the index in the sidecar format, so later runs can skip buildIndex().
+  void saveIndex(PBWriter& out) const
+  {
+    for (size_t n = 0; n < size(); n++)
+      out.writeFixed64(offset(n));
+  }
+  // Number of indexed records.
+  size_t size() const
+  {
+    return index_ ? index_->size() / 8 : offsets_.size();
+  }
+  // Record n; throws if there is no such record or the index points outside the file.
+  PBView operator[](size_t n) const
+  {
+    if (n >= size())
+      throw std::runtime_error("Invalid record index");
+    uint64_t at = offset(n);
+    if (at >= file_.size())
+      throw std::runtime_error("Invalid record index");
+    const unsigned char* p = file_.data() + at;
+    return PBRecords::read(p, file_.data() + file_.size());
+  }
+
+private:
+  uint64_t offset(size_t n) const
+  {
+    if (!index_)
+      return offsets_[n];
+    uint64_t at = 0;
+    for (size_t i = 0; i < 8; i++)
+      at |= uint64_t(index_->data()[n * 8 + i]) << (8 * i);
+    return at;
+  }
+
+  PBMappedFile                file_;
+  std::optional<PBMappedFile> index_;
+  std::vector<uint64_t>       offsets_;
+};
+#endif
+
+template <typename T>
+inline constexpr bool is_protobuf = false;
+
+// Wire description of a struct member, specialized by the generator for each field.
+struct PBMember
+{
+  uint32_t number;
+  wiretype type;
+  bool     zigzag;
+  // The member's bit in T::Fields, or 0 past the first 64 fields.
+  uint64_t bit = 0;
+};
+
+template <auto Member>
+inline constexpr PBMember pbMember = { 0, Varint, false };
+
+// Tuple of the repeated submessage members of T, specialized by the generator.
+template <typename T>
+inline constexpr auto pbRepeatedMessages = std::tuple<>();
+
+template <typename>
+struct PBMemberPointer;
+template <typename C, typename M>
+struct PBMemberPointer<M C::*>
+{
+  using Class = C;
+  using Type  = M;
+};
+
+template <typename T>
+struct PBUnlazy
+{
+  using type = T;
+};
+template <typename T>
+struct PBUnlazy<Lazy<T>>
+{
+  using type = T;
+};
+
+// What pb_get() returns for a member of type M: strings and bytes as views into the buffer,
+// submessages as their encoded bytes, scalars and enums by value.
+template <typename M>
+struct PBGetType
+{
+  using type = std::conditional_t<is_protobuf<typename PBUnlazy<M>::type>, PBView, M>;
+};
+template <typename C, typename T, typename A>
+struct PBGetType<std::basic_string<C, T, A>>
+{
+  using type = std::string_view;
+};
+template <typename A>
+struct PBGetType<std::vector<uint8_t, A>>
+{
+  using type = std::span<const uint8_t>;
+};
+
+template <auto Member>
+using PBGetResult = typename PBGetType<typename PBMemberPointer<decltype(Member)>::Type>::type;
+
+template <auto Member, auto... Path>
+constexpr auto pbPathStart()
+{
+  return Member;
+}
+
+template <auto Member, auto... Path>
+constexpr auto pbPathEnd()
+{
+  if constexpr (sizeof...(Path) == 0)
+    return Member;
+  else
+    return pbPathEnd<Path...>();
+}
+
+template <auto Member>
+PBGetResult<Member> pbGetValue(PBView::iterator& entry)
+{
+  using M = typename PBMemberPointer<decltype(Member)>::Type;
+  using R = PBGetResult<Member>;
+  if constexpr (std::is_same_v<R, std::string_view>)
+    return entry.readStringView();
+  else if constexpr (std::is_same_v<R, std::span<const uint8_t>>)
+    return entry.readBytesView();
+  else if constexpr (std::is_same_v<R, PBView>)
+    return entry.pbview();
+  else if constexpr (std::is_floating_point_v<M>)
+    return (M)entry.readDouble();
+  else if constexpr (pbMember<Member>.zigzag)
+    return (M)unzigzag(entry.read());
+  else
+  {
+    static_assert(std::is_arithmetic_v<M> || std::is_enum_v<M>,
+                  "repeated fields have no single value");
+    return (M)entry.read();
+  }
+}
+
+// Reads the field at the end of a path of members, e.g.
+//   pb_get<&Req::header, &Header::routing, &Routing::tenant_id>(data)
+// straight from the encoded message. Only the submessages along the path are entered and every
+// other field is skipped by its length. As in a full decode the last occurrence wins. Returns
+// nothing if the field is absent; repeated fields cannot be part of the path.
+template <auto Member, auto... Path>
+std::optional<PBGetResult<pbPathEnd<Member, Path...>()>> pb_get(PBView data)
+{
+  using M = typename PBMemberPointer<decltype(Member)>::Type;
+  static_assert(pbMember<Member>.number != 0, "not a member of a generated message");
+  constexpr PBTag tag(pbMember<Member>.number, pbMember<Member>.type);
+  std::optional<PBGetResult<pbPathEnd<Member, Path...>()>> result;
+  if constexpr (sizeof...(Path) == 0)
+  {
+    for (auto& entry : data)
+    {
+      if (entry.tag == tag.bytes)
+        result = pbGetValue<Member>(entry);
+    }
+  }
+  else
+  {
+    using Next = typename PBMemberPointer<decltype(pbPathStart<Path...>())>::Class;
+    static_assert(std::is_same_v<Next, typename PBUnlazy<M>::type>,
+                  "each member must belong to the submessage named before it");
+    for (auto& entry : data)
+    {
+      if (entry.tag != tag.bytes)
+        continue;
+      if (auto value = pb_get<Path...>(entry.pbview()))
+        result = value;
+    }
+  }
+  return result;
+}
+
+// One replacement in an encoded buffer: the `length` bytes at `offset` become head followed by
+// body. Neither may point into the buffer being edited.
+struct PBEdit
+{
+  size_t                   offset;
+  size_t                   length;
+  std::span<const uint8_t> head;
+  std::span<const uint8_t> body;
+  ptrdiff_t                delta() const
+  {
+    return ptrdiff_t(head.size() + body.size()) - ptrdiff_t(length);
+  }
+};
+
+// Applies edits sorted by offset. Edits that change the size must either all grow or all
+// shrink, as a field and the length prefixes around it do; every byte behind the first edit is
+// then moved at most once.
+inline void pbSplice(std::vector<uint8_t>& buffer, std::span<const PBEdit> edits)
+{
+  auto put = [&](const PBEdit& e, uint8_t* at)
+  {
+    if (!e.head.empty())
+      memcpy(at, e.head.data(), e.head.size());
+    if (!e.body.empty())
+      memcpy(at + e.head.size(), e.body.data(), e.body.size());
+  };
+  ptrdiff_t total = 0;
+  for (auto& e : edits)
+    total += e.delta();
+  size_t size = buffer.size();
+  if (total > 0)
+  {
+    // Growing: start at the back so nothing is overwritten before it has moved.
+    buffer.resize(size + total);
+    ptrdiff_t shift = total;
+    size_t    end   = size;
+    for (size_t n = edits.size(); n-- > 0;)
+    {
+      const PBEdit& e     = edits[n];
+      size_t        after = e.offset + e.length;
+      memmove(buffer.data() + after + shift, buffer.data() + after, end - after);
+      shift -= e.delta();
+      put(e, buffer.data() + e.offset + shift);
+      end = e.offset;
+    }
+    return;
+  }
+  ptrdiff_t shift = 0;
+  for (size_t n = 0; n < edits.size(); n++)
+  {
+    const PBEdit& e = edits[n];
+    put(e, buffer.data() + e.offset + shift);
+    shift += e.delta();
+    size_t after = e.offset + e.length;
+    size_t end   = n + 1 < edits.size() ? edits[n + 1].offset : size;
+    if (shift)
+      memmove(buffer.data() + after + shift, buffer.data() + after, end - after);
+  }
+  buffer.resize(size + total);
+}
+
+// Replaces the value of the field reached through `path`: the tags of the submessages to enter,
+// then the tag of the field itself. The new value is head followed by body, encoded without its
+// tag; for length-delimited fields head starts with the length. As in a decode, the last
+// occurrence at each step is the one that counts. A value of the same size is overwritten in
+// place. Otherwise the value and the length prefixes of all submessages around it are changed
+// in a single splice. A missing field, and any missing submessages on its path, are appended.
+inline void pbPatch(std::vector<uint8_t>&    buffer,
+                    std::span<const PBTag>   path,
+                    std::span<const uint8_t> head,
+                    std::span<const uint8_t> body)
+{
+  // The length prefix of each submessage entered and the length it holds.
+  struct Level
+  {
+    size_t offset;
+    size_t size;
+    size_t length;
+  };
+  std::vector<Level> levels;
+  size_t             begin = 0;
+  size_t             end   = buffer.size();
+  size_t             depth = 0;
+  PBEdit             leaf{ end, 0, head, body };
+  bool               found = false;
+  for (; depth < path.size(); depth++)
+  {
+    // Entries follow each other without gaps, so each one starts where the last one ended.
+    const unsigned char* base  = buffer.data();
+    size_t               start = begin;
+    size_t               hit   = SIZE_MAX;
+    size_t               value = 0;
+    size_t               length = 0;
+    for (auto& entry : PBView(base + begin, end - begin))
+    {
+      if (entry.tag == path[depth].bytes)
+      {
+        hit    = start;
+        value  = entry.data_ - base;
+        length = entry.length;
+      }
+      start = entry.data_ - base + entry.length;
+    }
+    if (hit == SIZE_MAX)
+      break;
+    size_t afterTag = hit + path[depth].size;
+    if (depth + 1 == path.size())
+    {
+      leaf.offset = afterTag;
+      leaf.length = value + length - afterTag;
+      found       = true;
+      break;
+    }
+    levels.push_back({ afterTag, value - afterTag, length });
+    begin = value;
+    end   = value + length;
+  }
+
+  std::vector<uint8_t> insert;
+  if (!found)
+  {
+    // Lengths of the submessages still to be created, from the innermost one outwards.
+    std::vector<size_t> lengths(path.size());
+    size_t              inner = path.back().size + head.size() + body.size();
+    for (size_t n = path.size() - 1; n-- > depth;)
+    {
+      lengths[n] = inner;
+      inner += path[n].size + varintSize(inner);
+    }
+    insert.reserve(inner - body.size());
+    auto addTag = [&](const PBTag& tag)
+    {
+      for (size_t n = 0; n < tag.size; n++)
+        insert.push_back(uint8_t(tag.bytes >> (8 * n)));
+    };
+    for (size_t n = depth; n + 1 < path.size(); n++)
+    {
+      uint8_t varint[10];
+      addTag(path[n]);
+      insert.insert(insert.end(), varint, encodeVarintSlow(varint, lengths[n]));
+    }
+    addTag(path.back());
+    insert.insert(insert.end(), head.begin(), head.end());
+    leaf = { end, 0, insert, body };
+  }
+  if (leaf.delta() == 0)
+  {
+    pbSplice(buffer, { &leaf, 1 });
+    return;
+  }
+
+  // Each enclosing length changes by the change inside it, including the prefixes nested deeper.
+  std::vector<PBEdit>                 edits(levels.size() + 1);
+  std::vector<std::array<uint8_t, 10>> prefixes(levels.size());
+  ptrdiff_t                           delta = leaf.delta();
+  edits.back()                              = leaf;
+  for (size_t n = levels.size(); n-- > 0;)
+  {
+    uint8_t* p    = prefixes[n].data();
+    size_t   size = encodeVarintSlow(p, levels[n].length + delta) - p;
+    edits[n]      = { levels[n].offset, levels[n].size, { p, size }, {} };
+    delta += ptrdiff_t(size) - ptrdiff_t(levels[n].size);
+  }
+  pbSplice(buffer, edits);
+}
+
+template <auto Member, auto... Path>
+constexpr bool pbPathValid()
+{
+  if constexpr (sizeof...(Path) == 0)
+    return pbMember<Member>.number != 0;
+  else
+  {
+    using M    = typename PBMemberPointer<decltype(Member)>::Type;
+    using Next = typename PBMemberPointer<decltype(pbPathStart<Path...>())>::Class;
+    return pbMember<Member>.number != 0 && std::is_same_v<Next, typename PBUnlazy<M>::type>
+           && pbPathValid<Path...>();
+  }
+}
+
+// Changes the field at the end of a path of members, e.g.
+//   pb_set<&Req::header, &Header::ttl>(buffer, 63)
+// directly in an encoded message, without decoding or re-encoding any other field. The value
+// takes the form pb_get() returns and must not point into `buffer`. See pbPatch() for how the
+// buffer is edited.
+template <auto Member, auto... Path>
+void pb_set(std::vector<uint8_t>& buffer, const PBGetResult<pbPathEnd<Member, Path...>()>& value)
+{
+  static_assert(pbPathValid<Member, Path...>(),
+                "each member must belong to the submessage named before it");
+  constexpr auto  Leaf   = pbPathEnd<Member, Path...>();
+  constexpr PBTag path[] = { PBTag(pbMember<Member>.number, pbMember<Member>.type),
+                             PBTag(pbMember<Path>.number, pbMember<Path>.type)... };
+  using M = typename PBMemberPointer<decltype(pbPathEnd<Member, Path...>())>::Type;
+  using R = PBGetResult<Leaf>;
+  uint8_t                  head[10];
+  size_t                   headSize = 0;
+  std::span<const uint8_t> body;
+  if constexpr (std::is_same_v<R, std::string_view>)
+    body = { (const uint8_t*)value.data(), value.size() };
+  else if constexpr (std::is_same_v<R, std::span<const uint8_t>>)
+    body = value;
+  else if constexpr (std::is_same_v<R, PBView>)
+    body = { value.data, value.size };
+  else if constexpr (pbMember<Leaf>.type == U32 || pbMember<Leaf>.type == U64)
+  {
+    using Bits = std::conditional_t<pbMember<Leaf>.type == U32, uint32_t, uint64_t>;
+    Bits bits;
+    if constexpr (std::is_floating_point_v<M>)
+      memcpy(&bits, &value, sizeof(bits));
+    else
+      bits = (Bits)value;
+    for (; headSize < sizeof(bits); headSize++)
+      head[headSize] = uint8_t(bits >> (8 * headSize));
+  }
+  else
+  {
+    static_assert(std::is_arithmetic_v<M> || std::is_enum_v<M>,
+                  "repeated fields have no single value");
+    headSize = encodeVarintSlow(head, toVarint<pbMember<Leaf>.zigzag>(value)) - head;
+  }
+  if constexpr (pbMember<Leaf>.type == Delim)
+    headSize = encodeVarintSlow(head, body.size()) - head;
+  pbPatch(buffer, path, { head, headSize }, body);
+}
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PB_VARINT_X86 1
+#endif
+
+// ceil(significant bits / 7) without a loop; zero still takes one byte.
+inline size_t varintSize(uint64_t value)
+{
+  return ((63 - std::countl_zero(value | 1)) * 9 + 73) / 64;
+}
+
+inline uint64_t zigzag(int64_t value)
+{
+  return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value)
+{
+  return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+template <bool ZigZag, typename T>
+uint64_t toVarint(T value)
+{
+  if constexpr (ZigZag)
+    return zigzag(value);
+  else if constexpr (std::is_enum_v<T>)
+    return (uint32_t)value;
+  else
+    return (uint64_t)value;
+}
+
+template <bool ZigZag, typename T>
+T fromVarint(uint64_t value)
+{
+  if constexpr (ZigZag)
+    return (T)unzigzag(value);
+  else if constexpr (std::is_same_v<T, bool>)
+    return value != 0;
+  else
+    return (T)value;
+}
+
+// Writes value at p and returns the end. Needs exactly varintSize(value) bytes of room.
+inline uint8_t* encodeVarintSlow(uint8_t* p, uint64_t value)
+{
+  while (value > 0x7F)
+  {
+    *p++ = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  *p++ = (uint8_t)value;
+  return p;
+}
+
+// Writes value at p and returns the end. Needs 10 bytes of room: the low 56 bits are spread
+// into 7-bit groups and written with one 8-byte store, the top bits with one 2-byte store.
+inline uint8_t* encodeVarint(uint8_t* p, uint64_t value)
+{
+  if (value < 0x80)
+  {
+    *p = (uint8_t)value;
+    return p + 1;
+  }
+  if constexpr (std::endian::native == std::endian::little)
+  {
+    size_t   len = varintSize(value);
+    uint64_t low = value & 0x00FFFFFFFFFFFFFFULL;
+#ifdef __BMI2__
+    uint64_t x = _pdep_u64(low, 0x7F7F7F7F7F7F7F7FULL);
+#else
+    uint64_t x = (low & 0x000000000FFFFFFFULL) | ((low & 0x00FFFFFFF0000000ULL) << 4);
+    x          = (x & 0x00003FFF00003FFFULL) | ((x & 0x0FFFC0000FFFC000ULL) << 2);
+    x          = (x & 0x007F007F007F007FULL) | ((x & 0x3F803F803F803F80ULL) << 1);
+#endif
+    uint64_t more = len > 8 ? ~0ULL : (1ULL << ((8 * (len - 1)) & 63)) - 1;
+    x |= 0x8080808080808080ULL & more;
+    uint16_t high = uint16_t(((value >> 56) & 0x7F) | (len > 9 ? 0x80 : 0) | ((value >> 63) << 8));
+    memcpy(p, &x, 8);
+    memcpy(p + 8, &high, 2);
+    return p + len;
+  }
+  else
+  {
+    return encodeVarintSlow(p, value);
+  }
+}
+
+// Batch form for packed arrays. Needs 10 bytes of room per value.
+template <bool ZigZag, typename It>
+uint8_t* encodeVarints(uint8_t* p, It first, It last)
+{
+  for (; first != last; ++first)
+    p = encodeVarint(p, toVarint<ZigZag>(*first));
+  return p;
+}
+
+// Byte-at-a-time decoder for the tail of a buffer and for 9 and 10 byte varints.
+inline uint64_t decodeVarintSlow(const unsigned char*& p, const unsigned char* end)
+{
+  uint64_t val = 0;
+  for (size_t shift = 0; shift < 64; shift += 7)
+  {
+    if (p == end)
+      throw std::runtime_error("Short packet");
+    uint8_t byte = *p++;
+    val |= uint64_t(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return val;
+  }
+  throw std::runtime_error("Invalid varint");
+}
+
+// Gathers the 7-bit groups of the bytes selected by `keep` from a little-endian word.
+inline uint64_t compactVarint(uint64_t word, uint64_t keep)
+{
+#ifdef __BMI2__
+  return _pext_u64(word, keep & 0x7F7F7F7F7F7F7F7FULL);
+#else
+  uint64_t x = word & keep & 0x7F7F7F7F7F7F7F7FULL;
+  x          = ((x & 0x7F007F007F007F00ULL) >> 1) | (x & 0x007F007F007F007FULL);
+  x          = ((x & 0x3FFF00003FFF0000ULL) >> 2) | (x & 0x00003FFF00003FFFULL);
+  x          = ((x & 0x0FFFFFFF00000000ULL) >> 4) | (x & 0x000000000FFFFFFFULL);
+  return x;
+#endif
+}
+
+// Decodes one varint from [p, end) and advances p past it. When at least eight bytes remain,
+// varints of up to eight bytes are decoded from a single load without a branch per byte.
+inline uint64_t decodeVarint(const unsigned char*& p, const unsigned char* end)
+{
+  if (p != end && *p < 0x80)
+    return *p++;
+  if constexpr (std::endian::native == std::endian::little)
+  {
+    if (end - p >= 8)
+    {
+      uint64_t word;
+      memcpy(&word, p, 8);
+      uint64_t stops = ~word & 0x8080808080808080ULL;
+      if (stops)
+      {
+        p += (std::countr_zero(stops) >> 3) + 1;
+        return compactVarint(word, stops ^ (stops - 1));
+      }
+    }
+  }
+  return decodeVarintSlow(p, end);
+}
+
+// Batch kernels decode up to `max` varints from [p, end) into `out`, advance p, and return how
+// many were decoded. decodeVarints() picks one at startup based on the CPU it runs on.
+using VarintKernel = size_t (*)(const unsigned char*& p, const unsigned char* end, uint64_t* out, size_t max);
+
+inline size_t decodeVarintsScalar(const unsigned char*& p, const unsigned char* end, uint64_t* out, size_t max)
+{
+  size_t n = 0;
+  // Packed arrays are mostly runs of small values, so take eight single-byte varints per step.
+  while (n + 8 <= max && end - p >= 8)
+  {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    if ((word & 0x8080808080808080ULL) == 0)
+    {
+      for (size_t i = 0; i < 8; i++)
+        out[n++] = p[i];
+      p += 8;
+    }
+    else
+    {
+      out[n++] = decodeVarint(p, end);
+    }
+  }
+  while (n < max && p != end)
+    out[n++] = decodeVarint(p, end);
+  return n;
+}
+
+#ifdef PB_VARINT_X86
+__attribute__((target("bmi2"))) inline uint64_t decodeVarintPext(const unsigned char*& p,
+                                                                 const unsigned char* end)
+{
+  if (end - p >= 8)
+  {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    uint64_t stops = ~word & 0x8080808080808080ULL;
+    if (stops)
+    {
+      p += (std::countr_zero(stops) >> 3) + 1;
+      return _pext_u64(word, (stops ^ (stops - 1)) & 0x7F7F7F7F7F7F7F7FULL);
+    }
+  }
+  return decodeVarintSlow(p, end);
+}
+
+// The continuation bits of a whole vector are gathered with one movemask. Leading single-byte
+// varints are widened directly; the first multi-byte one goes through the single decoder.
+__attribute__((target("sse2"))) inline size_t decodeVarintsSse2(const unsigned char*& p,
+                                                                const unsigned char* end,
+                                                                uint64_t*            out,
+                                                                size_t               max)
+{
+  size_t n = 0;
+  while (n + 16 <= max && end - p >= 16)
+  {
+    uint32_t cont = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p));
+    size_t   singles = cont ? std::countr_zero(cont) : 16;
+    for (size_t i = 0; i < singles; i++)
+      out[n + i] = p[i];
+    n += singles;
+    p += singles;
+    if (cont)
+      out[n++] = decodeVarint(p, end);
+  }
+  return n + decodeVarintsScalar(p, end, out + n, max - n);
+}
+
+__attribute__((target("avx2,bmi2"))) inline size_t decodeVarintsAvx2(const unsigned char*& p,
+                                                                     const unsigned char* end,
+                                                                     uint64_t*            out,
+                                                                     size_t               max)
+{
+  size_t n = 0;
+  while (n + 32 <= max && end - p >= 32)
+  {
+    uint32_t cont = (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)p));
+    size_t   singles = cont ? std::countr_zero(cont) : 32;
+    for (size_t i = 0; i < singles; i++)
+      out[n + i] = p[i];
+    n += singles;
+    p += singles;
+    if (cont)
+      out[n++] = decodeVarintPext(p, end);
+  }
+  while (n < max && p != end)
+    out[n++] = decodeVarintPext(p, end);
+  return n;
+}
+#endif
+
+inline VarintKernel selectVarintKernel()
+{
+#ifdef PB_VARINT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2"))
+    return decodeVarintsAvx2;
+  if (__builtin_cpu_supports("sse2"))
+    return decodeVarintsSse2;
+#endif
+  return decodeVarintsScalar;
+}
+
+// Selected on first use; a function-local static is safe to reach from other static initializers.
+inline VarintKernel varintKernel()
+{
+  static const VarintKernel kernel = selectVarintKernel();
+  return kernel;
+}
+
+// Decodes every varint in [p, end) and hands each one to emit.
+template <typename F>
+void decodeVarints(const unsigned char* p, const unsigned char* end, F&& emit)
+{
+  VarintKernel kernel = varintKernel();
+  uint64_t     values[64];
+  while (p != end)
+  {
+    size_t count = kernel(p, end, values, 64);
+    for (size_t n = 0; n < count; n++)
+      emit(values[n]);
+  }
+}